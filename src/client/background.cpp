@@ -17,7 +17,6 @@
 //////////////////////////////////////////////////////////////////////////////
 
 #include "background.hpp"
-#include "map.hpp"
 #include "view.hpp"
 #include "time.hpp"
 #include <nx/nx.hpp>
@@ -37,16 +36,17 @@ background::background(node n) {
     flipped = n["f"].get_bool();
     spr = nx::map["Back"][n["bS"] + ".img"][n["ani"].get_bool() ? "ani" : "back"][n["no"]];
 }
-void background::load() {
-    backgrounds.clear();
-    foregrounds.clear();
-    auto b = map::current["back"];
+void background::load(node m, std::vector<background> & backs,
+                      std::vector<background> & fronts) {
+    backs.clear();
+    fronts.clear();
+    auto b = m["back"];
     for (auto i = 0u; b[i]; ++i) {
         auto n = b[i];
         if (n["front"].get_bool())
-            foregrounds.emplace_back(n);
+            fronts.emplace_back(n);
         else
-            backgrounds.emplace_back(n);
+            backs.emplace_back(n);
     }
 }
 void background::render() {
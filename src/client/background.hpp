@@ -26,7 +26,7 @@ class background {
 public:
     background(node);
     void render();
-    static void load();
+    static void load(node, std::vector<background> & backs, std::vector<background> & fronts);
     sprite spr;
     int x, y, z;
     int rx, ry, cx, cy;
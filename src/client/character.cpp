@@ -22,8 +22,22 @@
 #include <nx/nx.hpp>
 #include <algorithm>
 #include <map>
+#include <tuple>
 
 namespace nl {
+struct character::look {
+    struct piece {
+        sprite spr;
+        // Relative to the body
+        int x, y;
+    };
+    std::vector<piece> pieces;
+    double delay;
+};
+namespace {
+// Keyed by the part ids, state, frame and whether it is flipped
+std::map<std::tuple<std::vector<unsigned>, std::string, int, bool>, character::look> looks;
+}
 character::part::part(unsigned p_id) { set(p_id); }
 void character::part::set(unsigned p_id) {
     m_id = p_id;
@@ -74,6 +88,39 @@ void character::render() {
     if (!pos.fh) { set_state("jump"); } else if (pos.left ^ pos.right) {
         set_state("walk1");
     } else { set_state("stand1"); }
+    auto const d = get_look().delay;
+    delay += time::delta * 1000;
+    if (delay >= d) {
+        delay -= d;
+        ++frame;
+        if (!nx::character["00002000.img"][state][frame]) { frame = 0; }
+    }
+    auto const x = static_cast<int>(pos.x);
+    auto const y = static_cast<int>(pos.y);
+    auto flags = sprite::relative;
+    if (flipped) { flags |= sprite::flipped; }
+    for (auto const & p : get_look().pieces) {
+        auto spr = p.spr;
+        spr.draw(x + p.x, y + p.y, flags);
+    }
+}
+character::look const & character::get_look() {
+    auto same = m_look && m_look_frame == frame && m_look_flipped == flipped
+                && m_look_state == state && m_look_ids.size() == m_parts.size();
+    for (auto i = 0u; same && i < m_parts.size(); ++i) { same = m_look_ids[i] == m_parts[i].m_id; }
+    if (same) { return *m_look; }
+    m_look_ids.clear();
+    for (auto & p : m_parts) { m_look_ids.push_back(p.m_id); }
+    m_look_state = state;
+    m_look_frame = frame;
+    m_look_flipped = flipped;
+    auto key = std::make_tuple(m_look_ids, state, frame, flipped);
+    auto it = looks.find(key);
+    if (it == looks.end()) { it = looks.emplace(std::move(key), make_look()).first; }
+    m_look = &it->second;
+    return *m_look;
+}
+character::look character::make_look() const {
     struct sub_part {
         node m_node;
         int x, y, z;
@@ -84,14 +131,6 @@ void character::render() {
     };
     std::map<std::string, mapping> mappings;
     std::vector<sub_part> sub_parts;
-    auto anim = nx::character["00002000.img"][state][frame];
-    auto d = anim["delay"].get_real(100);
-    delay += time::delta * 1000;
-    if (delay >= d) {
-        delay -= d;
-        ++frame;
-        if (!nx::character["00002000.img"][state][frame]) { frame = 0; }
-    }
     auto zmap = nx::base["zmap.img"];
     for (auto & p : m_parts) {
         auto n = p.m_node[state][frame];
@@ -116,8 +155,8 @@ void character::render() {
         for (auto & p : sub_parts) {
             if (!p.done) {
                 if (p.m_node.name() == "body") {
-                    p.x = static_cast<int>(pos.x);
-                    p.y = static_cast<int>(pos.y);
+                    p.x = 0;
+                    p.y = 0;
                     p.done = true;
                 } else
                     for (auto n : p.m_node["map"]) {
@@ -148,12 +187,10 @@ void character::render() {
     }
     std::sort(sub_parts.begin(), sub_parts.end(),
               [](sub_part const & a, sub_part const & b) { return a.z > b.z; });
-    auto flags = sprite::relative;
-    if (flipped) { flags |= sprite::flipped; }
-    for (auto & p : sub_parts) {
-        sprite spr = p.m_node;
-        spr.draw(p.x, p.y, flags);
-    }
+    look l;
+    for (auto & p : sub_parts) { l.pieces.push_back({p.m_node, p.x, p.y}); }
+    l.delay = nx::character["00002000.img"][state][frame]["delay"].get_real(100);
+    return l;
 }
 void character::update() { pos.update(); }
 }
@@ -29,11 +29,21 @@ struct character {
     };
     void render();
     void update();
+    struct look;
+    look const & get_look();
+    look make_look() const;
     physics pos;
     bool flipped{false};
     std::vector<part> m_parts;
     std::string state;
     int frame{0};
     double delay{0};
+    // How the parts fit together for the current frame, shared by every character that looks the
+    // same, along with what it was found for
+    look const * m_look{nullptr};
+    std::vector<unsigned> m_look_ids;
+    std::string m_look_state;
+    int m_look_frame{0};
+    bool m_look_flipped{false};
 };
 }
@@ -19,6 +19,7 @@
 #include "config.hpp"
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <algorithm>
 #include <map>
 #include <string>
 #include <functional>
@@ -34,10 +35,13 @@ bool fullscreen = false;
 bool vsync = true;
 bool limit_fps = false;
 bool debug = false;
+bool trace = false;
+bool async_textures = true;
 int target_fps = 100;
 int window_width = 1024, window_height = 768;
 int fullscreen_width = 1024, fullscreen_height = 768;
 int atlas_size = 0;
+int atlas_pages = 4;
 std::string map{"100000000"};
 // Stuff to hold configs and their mappings
 struct mapping {
@@ -78,6 +82,8 @@ void load() {
     fullscreen_height = mode->height;
     target_fps = mode->refreshRate;
     glGetIntegerv(GL_MAX_TEXTURE_SIZE, &atlas_size);
+    // Several pages of the biggest size would take gigabytes
+    atlas_size = std::min(atlas_size, 4096);
     // Then map the configs
     map_bool("rave", rave);
     map_bool("fullscreen", fullscreen);
@@ -85,12 +91,15 @@ void load() {
     map_bool("capfps", limit_fps);
     map_bool("stretch", stretch);
     map_bool("debug", debug);
+    map_bool("trace", trace);
+    map_bool("asynctextures", async_textures);
     map_int("fps", target_fps);
     map_int("winwidth", window_width);
     map_int("winheight", window_height);
     map_int("fullwidth", fullscreen_width);
     map_int("fullheight", fullscreen_height);
     map_int("atlassize", atlas_size);
+    map_int("atlaspages", atlas_pages);
     map_string("map", map);
     // First we save the defaults in case the config file doesn't have them
     for (auto const & m : mappings) m.second.save();
@@ -109,6 +118,9 @@ void load() {
             configs[m[1]] = m[2];
         }
     for (auto const & m : mappings) m.second.load();
+    // Configs from before paging saved GL_MAX_TEXTURE_SIZE as the atlas size, and several pages
+    // of that would still take gigabytes, so only a single page may go past the cap
+    if (atlas_pages > 1) atlas_size = std::min(atlas_size, 4096);
     // And then we save the config back
     save();
 }
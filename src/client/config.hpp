@@ -27,10 +27,16 @@ extern bool fullscreen;
 extern bool vsync;
 extern bool limit_fps;
 extern bool debug;
+// Whether to record which nodes get used, for wztonx --order
+extern bool trace;
+// Whether big bitmaps get decoded in the background, skipping them until they are ready
+extern bool async_textures;
 extern int target_fps;
 extern int window_width, window_height;
 extern int fullscreen_width, fullscreen_height;
 extern int atlas_size;
+// How many atlas textures to fill before evicting the least recently used
+extern int atlas_pages;
 extern std::string map;
 void save();
 void load();
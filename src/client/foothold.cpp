@@ -18,7 +18,6 @@
 
 #include "foothold.hpp"
 #include "config.hpp"
-#include "map.hpp"
 #include "sprite.hpp"
 #include "view.hpp"
 #include <algorithm>
@@ -39,26 +38,26 @@ foothold::foothold(node n, int id, int group, int layer) : id{id}, group{group},
     cant_through = n["cantThrough"].get_bool();
     forbid_fall_down = n["forbidFallDown"].get_bool();
 }
-void foothold::load() {
-    footholds.clear();
-    for (auto layern : map::current["foothold"]) {
+void foothold::load(node m, std::vector<foothold> & fhs) {
+    fhs.clear();
+    for (auto layern : m["foothold"]) {
         auto layeri = std::stoi(layern.name());
         for (auto groupn : layern) {
             auto groupi = std::stoi(groupn.name());
             for (auto idn : groupn) {
                 auto idi = std::stoi(idn.name());
-                footholds.emplace_back(idn, idi, groupi, layeri);
+                fhs.emplace_back(idn, idi, groupi, layeri);
             }
         }
     }
-    std::sort(footholds.begin(), footholds.end(),
+    std::sort(fhs.begin(), fhs.end(),
               [](foothold const & p_1, foothold const & p_2) { return p_1.id < p_2.id; });
-    for (auto & fh : footholds) {
+    for (auto & fh : fhs) {
         auto pred = [](foothold const & p_fh, int p_id) { return p_fh.id < p_id; };
-        auto nextit = std::lower_bound(footholds.cbegin(), footholds.cend(), fh.nextid, pred);
-        fh.next = nextit != footholds.cend() && nextit->id == fh.nextid ? &*nextit : nullptr;
-        auto previt = std::lower_bound(footholds.cbegin(), footholds.cend(), fh.previd, pred);
-        fh.prev = previt != footholds.cend() && previt->id == fh.previd ? &*previt : nullptr;
+        auto nextit = std::lower_bound(fhs.cbegin(), fhs.cend(), fh.nextid, pred);
+        fh.next = nextit != fhs.cend() && nextit->id == fh.nextid ? &*nextit : nullptr;
+        auto previt = std::lower_bound(fhs.cbegin(), fhs.cend(), fh.previd, pred);
+        fh.prev = previt != fhs.cend() && previt->id == fh.previd ? &*previt : nullptr;
     }
 }
 void foothold::draw_lines() {
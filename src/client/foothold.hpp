@@ -24,7 +24,7 @@ namespace nl {
 class foothold {
 public:
     foothold(node, int, int, int);
-    static void load();
+    static void load(node, std::vector<foothold> &);
     static void draw_lines();
     foothold const *next, *prev;
     int x1, y1, x2, y2;
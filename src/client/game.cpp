@@ -26,6 +26,7 @@
 #include "player.hpp"
 #include "sprite.hpp"
 #include <nx/nx.hpp>
+#include <nx/trace.hpp>
 
 namespace nl {
 namespace game {
@@ -35,6 +36,7 @@ void init() {
     config::load();
     sprite::init();
     time::reset();
+    if (config::trace) trace::start();
     nx::load_all();
     music::init();
     window::recreate(config::fullscreen);
@@ -49,8 +51,11 @@ void loop() {
     window::update();
 }
 void unload() {
+    if (trace::recording()) trace::stop("NoLifeClient.nxtrace");
     music::unload();
     config::save();
+    map::unload();
+    sprite::unload();
     window::unload();
 }
 void play() {
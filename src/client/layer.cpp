@@ -17,25 +17,120 @@
 //////////////////////////////////////////////////////////////////////////////
 
 #include "layer.hpp"
-#include "map.hpp"
 #include "player.hpp"
+#include "view.hpp"
 #include <nx/nx.hpp>
 #include <algorithm>
 
 namespace nl {
 std::array<layer, 8> layers;
+namespace {
+int const cell_size{256};
+// Limits on runs so that a run can still be mostly culled and is cheap to make again
+uint32_t const run_length{256};
+int const run_extent{1024};
+// Rounds towards negative infinity, unlike /
+int cell(int p) { return (p >= 0 ? p : p - cell_size + 1) / cell_size; }
+}
 void layer::render() {
     for (auto i = 0u; i < 8; ++i) {
-        for (auto & o : layers[i].objs) o.render();
-        for (auto & t : layers[i].tiles) t.render();
+        layers[i].draw();
         if (player::ch.pos.layer == static_cast<int>(i)) player::render();
     }
 }
-void layer::load() {
+void layer::build_grid() {
+    cells.clear();
+    flowing.clear();
+    runs.clear();
+    auto const count = static_cast<uint32_t>(objs.size() + tiles.size());
+    run_at.assign(count, 0);
+    std::vector<std::pair<uint32_t, sprite::box>> items;
+    for (auto i = 0u; i < count; ++i) {
+        auto const o = i < objs.size();
+        if (o && objs[i].flows()) {
+            flowing.push_back(i);
+            continue;
+        }
+        auto const b = o ? objs[i].bounds() : tiles[i - objs.size()].bounds();
+        if (!(o ? objs[i].still() : tiles[i - objs.size()].still())) {
+            items.emplace_back(i, b);
+            continue;
+        }
+        if (!runs.empty() && runs.back().last + 1 == i
+            && runs.back().last - runs.back().first + 1 < run_length) {
+            auto & r = runs.back().bounds;
+            auto const u = sprite::box{std::min(r.left, b.left), std::min(r.top, b.top),
+                                       std::max(r.right, b.right), std::max(r.bottom, b.bottom)};
+            if (u.right - u.left <= run_extent && u.bottom - u.top <= run_extent) {
+                r = u;
+                runs.back().last = i;
+                run_at[i] = static_cast<uint32_t>(runs.size());
+                continue;
+            }
+        }
+        runs.push_back({i, i, b, {}});
+        run_at[i] = static_cast<uint32_t>(runs.size());
+    }
+    for (auto const & r : runs) { items.emplace_back(r.first, r.bounds); }
+    if (items.empty()) { return; }
+    auto b = items.front().second;
+    for (auto const & it : items) {
+        b.left = std::min(b.left, it.second.left);
+        b.top = std::min(b.top, it.second.top);
+        b.right = std::max(b.right, it.second.right);
+        b.bottom = std::max(b.bottom, it.second.bottom);
+    }
+    left = cell(b.left);
+    top = cell(b.top);
+    columns = cell(b.right) - left + 1;
+    rows = cell(b.bottom) - top + 1;
+    cells.resize(static_cast<size_t>(columns) * rows);
+    for (auto const & it : items) {
+        for (auto y = cell(it.second.top); y <= cell(it.second.bottom); ++y) {
+            for (auto x = cell(it.second.left); x <= cell(it.second.right); ++x) {
+                cells[static_cast<size_t>(y - top) * columns + x - left].push_back(it.first);
+            }
+        }
+    }
+}
+void layer::draw() {
+    visible = flowing;
+    if (!cells.empty()) {
+        auto const x0 = std::max(cell(view::xmin) - left, 0);
+        auto const x1 = std::min(cell(view::xmin + view::width) - left, columns - 1);
+        auto const y0 = std::max(cell(view::ymin) - top, 0);
+        auto const y1 = std::min(cell(view::ymin + view::height) - top, rows - 1);
+        for (auto y = y0; y <= y1; ++y) {
+            for (auto x = x0; x <= x1; ++x) {
+                auto const & c = cells[static_cast<size_t>(y) * columns + x];
+                visible.insert(visible.end(), c.begin(), c.end());
+            }
+        }
+    }
+    // Things spanning several cells show up more than once, and sorting restores the z order
+    std::sort(visible.begin(), visible.end());
+    visible.erase(std::unique(visible.begin(), visible.end()), visible.end());
+    for (auto i : visible) {
+        if (!run_at[i]) {
+            draw(i);
+            continue;
+        }
+        auto & r = runs[run_at[i] - 1];
+        r.cache.draw(r.bounds.left, r.bounds.top, [this, &r] {
+            for (auto j = r.first; j <= r.last; ++j) { draw(j); }
+        });
+    }
+}
+void layer::draw(uint32_t i) {
+    if (i < objs.size()) {
+        objs[i].render();
+    } else { tiles[i - objs.size()].render(); }
+}
+void layer::load(node m, std::array<layer, 8> & ls) {
     auto tile_node = nx::map["Tile"];
     for (auto i = 0u; i < 8; ++i) {
-        auto & l = layers[i];
-        auto n = map::current[i];
+        auto & l = ls[i];
+        auto n = m[i];
         auto tn = tile_node[n["info"]["tS"] + ".img"];
         l.objs.clear();
         for (auto nn : n["obj"]) l.objs.emplace_back(nn);
@@ -47,6 +142,7 @@ void layer::load() {
         for (auto nn : n["tile"]) l.tiles.emplace_back(nn, tn);
         std::sort(l.tiles.begin(), l.tiles.end(),
                   [](tile const & a, tile const & b) { return a.z < b.z; });
+        l.build_grid();
     }
 }
 }
@@ -21,16 +21,38 @@
 #include "obj.hpp"
 #include <vector>
 #include <array>
+#include <cstdint>
 
 namespace nl {
 class layer {
 public:
     static void render();
-    static void load();
+    // Fills in the layers of a map, which can be done away from the main thread
+    static void load(node, std::array<layer, 8> &);
     std::vector<obj> objs;
     std::vector<tile> tiles;
 
 private:
+    void build_grid();
+    void draw();
+    void draw(uint32_t);
+    // Each cell of the grid lists what can be seen in it, objs first and then tiles, numbered
+    // in the order they are drawn
+    std::vector<std::vector<uint32_t>> cells;
+    int left, top, columns, rows;
+    // Flowing objs can be anywhere so they are always drawn
+    std::vector<uint32_t> flowing;
+    std::vector<uint32_t> visible;
+    // Still things next to each other in the z order are drawn together from a buffer, and only
+    // the first of them goes in the grid
+    struct run {
+        uint32_t first, last;
+        sprite::box bounds;
+        geometry cache;
+    };
+    std::vector<run> runs;
+    // Which run each thing belongs to, plus one, or zero for none
+    std::vector<uint32_t> run_at;
 };
 extern std::array<layer, 8> layers;
 }
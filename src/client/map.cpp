@@ -32,6 +32,10 @@
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <future>
+#include <memory>
 #include <random>
 #include <iostream>
 
@@ -43,6 +47,15 @@ node current, next;
 std::string next_portal;
 std::string current_name;
 bool old_style;
+// Everything the next map needs, built on a thread of its own while the current one keeps going
+struct staged {
+    node map;
+    std::array<layer, 8> layers;
+    std::vector<background> backgrounds, foregrounds;
+    std::vector<foothold> footholds;
+    std::vector<portal> portals;
+};
+std::future<std::unique_ptr<staged>> loading;
 void load(std::string name, std::string port) {
     if (name.size() < 9) { name.insert(0, 9 - name.size(), '0'); }
     if (name == current_name) { return player::respawn(port); }
@@ -50,7 +63,8 @@ void load(std::string name, std::string port) {
                        : map_node[std::string("Map") + name[0]][name + ".img"];
     // If the map is invalid just ignore it
     if (!m) { return; }
-    // Some maps link to other maps. I have no idea why.
+    // Some maps link to other maps. I have no idea why. wztonx puts the linked map in place of
+    // the one linking to it, so this is only for files converted before it did that.
     if (m["info"]["link"]) { return load(m["info"]["link"], port); }
     next = m;
     next_portal = port;
@@ -76,8 +90,19 @@ void load_random() {
     std::uniform_int_distribution<size_t> dist(0, all_maps.size() - 1);
     load(all_maps[dist(rand)], "sp");
 }
-void load_now() {
-    current = next;
+std::unique_ptr<staged> build(node m) {
+    std::unique_ptr<staged> s{new staged{}};
+    s->map = m;
+    layer::load(m, s->layers);
+    background::load(m, s->backgrounds, s->foregrounds);
+    foothold::load(m, s->footholds);
+    portal::load(m, s->portals);
+    return s;
+}
+// Swaps what was built for the current map, leaving the old one in its place to be destroyed on
+// the main thread
+void load_now(staged & s) {
+    current = s.map;
     current_name = current.name();
     current_name.erase(current_name.find(".img"));
     config::map = current_name;
@@ -87,10 +112,11 @@ void load_now() {
     }
     time::reset();
     music::play();
-    layer::load();
-    background::load();
-    foothold::load();
-    portal::load();
+    std::swap(layers, s.layers);
+    backgrounds.swap(s.backgrounds);
+    foregrounds.swap(s.foregrounds);
+    footholds.swap(s.footholds);
+    portals.swap(s.portals);
     player::respawn(next_portal);
     view::reset();
 }
@@ -102,11 +128,22 @@ void init() {
     load_random(); // Just in case loading the config'd map fails
     load(config::map, "sp");
     if (!next) { throw std::runtime_error{"No map to load!"}; }
-    load_now();
+    load_now(*build(next));
+}
+void unload() {
+    if (loading.valid()) { loading.wait(); }
+    loading = {};
+    for (auto & l : layers) { l = layer{}; }
 }
 void update() {
     player::update();
-    if (next != current) load_now();
+    if (loading.valid()) {
+        if (loading.wait_for(std::chrono::seconds{0}) != std::future_status::ready) { return; }
+        auto s = loading.get();
+        // Another map could have been asked for in the meantime
+        if (s->map == next) { load_now(*s); }
+    }
+    if (next != current) { loading = std::async(std::launch::async, build, next); }
 }
 void render() {
     for (auto & b : backgrounds) { b.render(); }
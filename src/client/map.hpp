@@ -25,6 +25,8 @@ namespace map {
 extern node current;
 extern std::string current_name;
 void init();
+// Waits for a map still being loaded and frees what the current one keeps on the GPU
+void unload();
 void random();
 void load_random();
 void load(std::string name, std::string port);
@@ -55,4 +55,10 @@ void obj::render() {
     }
     spr.draw(dx, dy, flags, cx, cy);
 }
+bool obj::flows() const { return (flow & 3) != 0; }
+bool obj::still() const { return !flows() && spr.still(); }
+sprite::box obj::bounds() const {
+    auto b = spr.bounds();
+    return {x + b.left, y + b.top, x + b.right, y + b.bottom};
+}
 }
@@ -25,6 +25,12 @@ class obj {
 public:
     obj(node);
     void render();
+    // Whether the obj flows, in which case it can show up anywhere
+    bool flows() const;
+    // Where in the map the obj can show up if it doesn't flow
+    sprite::box bounds() const;
+    // Whether the obj looks the same every frame
+    bool still() const;
     int x, y, z, zm, zid;
 
 private:
@@ -19,16 +19,15 @@
 //////////////////////////////////////////////////////////////////////////////
 
 #include "portal.hpp"
-#include "map.hpp"
 #include <nx/nx.hpp>
 
 namespace nl {
 std::vector<portal> portals;
 node portal_sprites;
-void portal::load() {
+void portal::load(node m, std::vector<portal> & ps) {
     portal_sprites = nx::map["MapHelper.img"]["portal"]["game"];
-    portals.clear();
-    for (node n : map::current["portal"]) portals.emplace_back(n);
+    ps.clear();
+    for (node n : m["portal"]) ps.emplace_back(n);
 }
 portal::portal(node n) : x(n["x"]), y(n["y"]), tm(n["tm"]), tn(n["tn"]), pt(n["pt"]), pn(n["pn"]) {
     switch (pt) {
@@ -28,7 +28,7 @@ namespace nl {
 class portal {
 public:
     portal(node);
-    static void load();
+    static void load(node, std::vector<portal> &);
     void render();
     int pt, tm, delay;
     int x, y;
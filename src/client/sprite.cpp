@@ -21,6 +21,7 @@
 #include "time.hpp"
 #include "view.hpp"
 #include "log.hpp"
+#include "stream.hpp"
 #include "window.hpp"
 #include <nx/bitmap.hpp>
 #include <GL/glew.h>
@@ -30,10 +31,13 @@
 #include <chrono>
 #include <cmath>
 #include <complex>
+#include <cstddef>
+#include <cstring>
 #include <deque>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <unordered_map>
 #include <vector>
 
@@ -41,135 +45,524 @@ namespace nl {
 namespace {
 struct texture {
     GLfloat top, left, bottom, right;
+    // Top left corner in texels
+    GLushort x, y;
+    size_t page;
     std::chrono::steady_clock::time_point last_use;
 };
 struct block {
     GLint x, y;
     GLint w, h;
 };
+struct page {
+    GLuint id;
+    std::multimap<GLint, block> hblocks, wblocks;
+    // When geometry last drew from the page, since it doesn't touch each texture
+    std::chrono::steady_clock::time_point last_use;
+};
 struct vertex {
     GLfloat r, g, b, a;
     GLfloat x, y;
     GLfloat s, t;
 };
+// Everything the shader needs to draw a quad, so it doesn't need four vertices
+struct instance {
+    GLshort x, y;
+    // A negative width flips the quad horizontally
+    GLshort w, h;
+    // What the quad rotates around, relative to its top left corner
+    GLshort px, py;
+    // Top left corner of the bitmap in the atlas, in texels
+    GLushort s, t;
+    GLubyte r, g, b, a;
+    GLfloat angle;
+    // The quad repeats the bitmap this many times, this far apart
+    GLushort nx, ny;
+    GLushort cx, cy;
+};
+char const vertex_shader[] = R"(#version 130
+in vec2 position;
+in vec2 size;
+in vec2 pivot;
+in vec2 texel;
+in vec4 color;
+in float angle;
+in vec2 count;
+in vec2 period;
+out vec2 local;
+out vec4 tint;
+flat out vec2 origin;
+flat out vec2 extent;
+flat out vec2 spacing;
+flat out float flipped;
+void main() {
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+    extent = vec2(abs(size.x), size.y);
+    local = corner * ((count - 1) * period + extent);
+    vec2 p = local - pivot;
+    p = vec2(p.x * cos(angle) - p.y * sin(angle), p.x * sin(angle) + p.y * cos(angle)) + pivot;
+    gl_Position = gl_ModelViewProjectionMatrix * vec4(position + p, 0, 1);
+    tint = color;
+    origin = texel;
+    spacing = period;
+    flipped = size.x < 0 ? 1 : 0;
+}
+)";
+// Repeats of the bitmap are found by wrapping around within each quad, leaving the gaps between
+// them empty. Rave mode uses GL_BLEND as the texture environment, which is mimicked here
+char const fragment_shader[] = R"(#version 130
+uniform sampler2D atlas;
+uniform float atlas_size;
+uniform bool rave;
+uniform vec3 env;
+in vec2 local;
+in vec4 tint;
+flat in vec2 origin;
+flat in vec2 extent;
+flat in vec2 spacing;
+flat in float flipped;
+void main() {
+    vec2 cell = mod(local, spacing);
+    if (cell.x >= extent.x || cell.y >= extent.y) discard;
+    if (flipped != 0) cell.x = extent.x - cell.x;
+    vec4 t = texture(atlas, (origin + cell) / atlas_size);
+    gl_FragColor = rave ? vec4(mix(tint.rgb, env, t.rgb), tint.a * t.a) : t * tint;
+}
+)";
+char const * const attributes[] = {"position", "size", "pivot", "texel",
+                                   "color", "angle", "count", "period"};
+// Bitmaps smaller than this decode quickly enough to do it on the spot
+uint32_t const async_size{0x10000};
 double const tau{6.28318530717958647692528676655900576839433879875021};
 std::unordered_map<size_t, texture> textures{};
-std::multimap<GLint, block> hblocks{};
-std::multimap<GLint, block> wblocks{};
+std::vector<page> pages{};
+size_t current{0};
+sprite::counters counts{};
 bool bound{false};
-GLuint vbo{};
-GLuint atlas{};
-std::vector<vertex> vertices{};
-texture & get_texture(bitmap const &);
+// Quads go in a ring that stays mapped when the driver can do that, otherwise they are kept in
+// memory and copied into a freshly orphaned buffer for each batch
+size_t const ring_size{0x10000};
+// Most quads one batch can hold, so the indices fit in 16 bits
+size_t const batch_quads{0x4000};
+struct fence {
+    uint64_t start;
+    GLsync sync;
+};
+GLuint vbo{}, ibo{};
+char * ring{nullptr};
+std::vector<char> heap{};
+// Bytes per quad, an instance when there's a shader to expand them and four vertices otherwise
+size_t stride{4 * sizeof(vertex)};
+GLuint program{};
+GLint rave_uniform{}, env_uniform{};
+// Positions count every quad written since the start rather than wrapping around
+uint64_t head{0}, batch_start{0};
+std::deque<fence> fences{};
+// What geometry::draw collects quads into instead of the ring
+struct recording {
+    std::vector<char> data;
+    std::vector<std::pair<size_t, size_t>> groups;
+    int x, y;
+    bool complete;
+};
+recording * record{nullptr};
+// Goes up whenever a page is emptied, so geometry knows its texture coordinates may be wrong
+uint64_t generation{1};
 void reinit() {
     glEnable(GL_FRAMEBUFFER_SRGB);
     glEnable(GL_TEXTURE_2D);
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glBindTexture(GL_TEXTURE_2D, atlas);
+    glBindTexture(GL_TEXTURE_2D, pages[current].id);
     glLoadIdentity();
-    vertices.clear();
+    batch_start = head;
     bound = true;
 }
-void add_block(GLint x, GLint y, GLint w, GLint h) {
+GLuint compile(GLenum type, char const * source) {
+    auto shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, nullptr);
+    glCompileShader(shader);
+    GLint ok;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char info[0x400];
+        glGetShaderInfoLog(shader, sizeof(info), nullptr, info);
+        log << "Failed to compile shader: " << info << std::endl;
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+// Builds the program for drawing instances, leaving it zero if that fails
+void link() {
+    auto vs = compile(GL_VERTEX_SHADER, vertex_shader);
+    auto fs = compile(GL_FRAGMENT_SHADER, fragment_shader);
+    if (vs && fs) {
+        program = glCreateProgram();
+        glAttachShader(program, vs);
+        glAttachShader(program, fs);
+        for (auto i = 0u; i < 8; ++i) { glBindAttribLocation(program, i, attributes[i]); }
+        glLinkProgram(program);
+        GLint ok;
+        glGetProgramiv(program, GL_LINK_STATUS, &ok);
+        if (!ok) {
+            char info[0x400];
+            glGetProgramInfoLog(program, sizeof(info), nullptr, info);
+            log << "Failed to link shader: " << info << std::endl;
+            glDeleteProgram(program);
+            program = 0;
+        }
+    }
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+    if (!program) { return; }
+    glUseProgram(program);
+    glUniform1f(glGetUniformLocation(program, "atlas_size"),
+                static_cast<GLfloat>(config::atlas_size));
+    rave_uniform = glGetUniformLocation(program, "rave");
+    env_uniform = glGetUniformLocation(program, "env");
+    glUseProgram(0);
+}
+GLubyte unorm(float v) {
+    return static_cast<GLubyte>(std::round(std::min(std::max(v, 0.f), 1.f) * 255));
+}
+void draw_instances(size_t offset, uint64_t n) {
+    glUseProgram(program);
+    glUniform1i(rave_uniform, config::rave);
+    glUniform3f(env_uniform, unorm(1 - view::r) / 255.f, unorm(1 - view::g) / 255.f,
+                unorm(1 - view::b) / 255.f);
+    auto attribute = [offset](GLuint i, GLint size, GLenum type, bool normalize, size_t member) {
+        glEnableVertexAttribArray(i);
+        glVertexAttribPointer(i, size, type, normalize, sizeof(instance),
+                              reinterpret_cast<GLvoid const *>(offset + member));
+        glVertexAttribDivisor(i, 1);
+    };
+    attribute(0, 2, GL_SHORT, false, offsetof(instance, x));
+    attribute(1, 2, GL_SHORT, false, offsetof(instance, w));
+    attribute(2, 2, GL_SHORT, false, offsetof(instance, px));
+    attribute(3, 2, GL_UNSIGNED_SHORT, false, offsetof(instance, s));
+    attribute(4, 4, GL_UNSIGNED_BYTE, true, offsetof(instance, r));
+    attribute(5, 1, GL_FLOAT, false, offsetof(instance, angle));
+    attribute(6, 2, GL_UNSIGNED_SHORT, false, offsetof(instance, nx));
+    attribute(7, 2, GL_UNSIGNED_SHORT, false, offsetof(instance, cx));
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, static_cast<GLsizei>(n));
+    for (auto i = 0u; i < 8; ++i) {
+        glVertexAttribDivisor(i, 0);
+        glDisableVertexAttribArray(i);
+    }
+    glUseProgram(0);
+}
+void draw_vertices(size_t offset, uint64_t n) {
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glColorPointer(4, GL_FLOAT, sizeof(vertex),
+                   reinterpret_cast<GLvoid const *>(offset + 0 * sizeof(GLfloat)));
+    glVertexPointer(2, GL_FLOAT, sizeof(vertex),
+                    reinterpret_cast<GLvoid const *>(offset + 4 * sizeof(GLfloat)));
+    glTexCoordPointer(2, GL_FLOAT, sizeof(vertex),
+                      reinterpret_cast<GLvoid const *>(offset + 6 * sizeof(GLfloat)));
+    glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(n * 6), GL_UNSIGNED_SHORT, nullptr);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+// Draws the quads written since the last submit
+void submit() {
+    auto const n = head - batch_start;
+    if (!n) { return; }
+    auto offset = batch_start % ring_size * stride;
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    if (!ring) {
+        glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(ring_size * stride), nullptr,
+                     GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, static_cast<GLsizeiptr>(n * stride),
+                        heap.data() + batch_start * stride);
+        offset = 0;
+    }
+    if (program) { draw_instances(offset, n); } else { draw_vertices(offset, n); }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    if (ring) {
+        fences.push_back({batch_start, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0)});
+    } else { head = 0; }
+    batch_start = head;
+}
+// Room for another quad in the current batch
+char * quad() {
+    if (record) {
+        record->data.resize(record->data.size() + stride);
+        ++record->groups.back().second;
+        return record->data.data() + record->data.size() - stride;
+    }
+    // A batch has to be contiguous and small enough to index
+    if (head != batch_start && (head % ring_size == 0 || head - batch_start == batch_quads)) {
+        submit();
+    }
+    // Wait for the GPU to be done with whatever was last written here
+    while (!fences.empty() && fences.front().start + ring_size <= head) {
+        glClientWaitSync(fences.front().sync, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(fences.front().sync);
+        fences.pop_front();
+    }
+    auto const q = (ring ? ring : heap.data()) + head % ring_size * stride;
+    ++head;
+    return q;
+}
+void add_block(page & p, GLint x, GLint y, GLint w, GLint h) {
     if (w <= 0 || h <= 0) { return; }
-    if (w > h) { hblocks.insert({h, {x, y, w, h}}); } else {
-        wblocks.insert({w, {x, y, w, h}});
+    if (w > h) { p.hblocks.insert({h, {x, y, w, h}}); } else {
+        p.wblocks.insert({w, {x, y, w, h}});
     }
 }
-void reset_blocks() {
-    hblocks.clear();
-    wblocks.clear();
-    textures.clear();
-    add_block(0, 0, config::atlas_size, config::atlas_size);
+void reset_blocks(page & p) {
+    p.hblocks.clear();
+    p.wblocks.clear();
+    add_block(p, 0, 0, config::atlas_size, config::atlas_size);
 }
-block get_block(GLint p_width, GLint p_height) {
-    if (std::max(p_width, p_height) > config::atlas_size) {
-        throw std::runtime_error{"Texture is too big"};
+void add_page() {
+    page p;
+    glGenTextures(1, &p.id);
+    glBindTexture(GL_TEXTURE_2D, p.id);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_SRGB8_ALPHA8, config::atlas_size, config::atlas_size, 0,
+                 GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    reset_blocks(p);
+    pages.push_back(std::move(p));
+    if (bound) { glBindTexture(GL_TEXTURE_2D, pages[current].id); }
+}
+// Empties the page whose textures have gone the longest without being drawn
+size_t evict() {
+    std::vector<std::chrono::steady_clock::time_point> used(pages.size());
+    for (auto i = 0u; i < pages.size(); ++i) { used[i] = pages[i].last_use; }
+    for (auto const & t : textures) {
+        auto & u = used[t.second.page];
+        u = std::max(u, t.second.last_use);
     }
-    if (p_width <= 0 || p_height <= 0) { throw std::runtime_error{"Invalid texture size"}; }
+    auto p = static_cast<size_t>(std::min_element(used.begin(), used.end()) - used.begin());
+    sprite::flush();
+    for (auto it = textures.begin(); it != textures.end();) {
+        if (it->second.page == p) {
+            it = textures.erase(it);
+            ++counts.evictions;
+        } else { ++it; }
+    }
+    reset_blocks(pages[p]);
+    ++counts.wipes;
+    ++generation;
+    return p;
+}
+bool get_block(page & p, GLint p_width, GLint p_height, block & b) {
     auto itw = std::find_if(
-        wblocks.lower_bound(p_width), wblocks.end(),
-        [&](std::pair<GLint const, block> const & p) { return p_height <= p.second.h; });
+        p.wblocks.lower_bound(p_width), p.wblocks.end(),
+        [&](std::pair<GLint const, block> const & e) { return p_height <= e.second.h; });
     auto ith = std::find_if(
-        hblocks.lower_bound(p_height), hblocks.end(),
-        [&](std::pair<GLint const, block> const & p) { return p_width <= p.second.w; });
-    block b;
-    if (itw != wblocks.end()
-        && (ith == hblocks.end() || itw->first - p_width <= ith->first - p_height)) {
+        p.hblocks.lower_bound(p_height), p.hblocks.end(),
+        [&](std::pair<GLint const, block> const & e) { return p_width <= e.second.w; });
+    if (itw != p.wblocks.end()
+        && (ith == p.hblocks.end() || itw->first - p_width <= ith->first - p_height)) {
         b = itw->second;
-        wblocks.erase(itw);
-    } else if (ith != hblocks.end()) {
+        p.wblocks.erase(itw);
+    } else if (ith != p.hblocks.end()) {
         b = ith->second;
-        hblocks.erase(ith);
-    } else {
-        sprite::flush();
-        log << "Wiping texture atlas" << std::endl;
-        reset_blocks();
-        return get_block(p_width, p_height);
-    }
+        p.hblocks.erase(ith);
+    } else { return false; }
     if (b.w - p_width > b.h - p_height) {
-        add_block(b.x + p_width, b.y, b.w - p_width, b.h);
-        add_block(b.x, b.y + p_height, p_width, b.h - p_height);
+        add_block(p, b.x + p_width, b.y, b.w - p_width, b.h);
+        add_block(p, b.x, b.y + p_height, p_width, b.h - p_height);
     } else {
-        add_block(b.x + p_width, b.y, b.w - p_width, p_height);
-        add_block(b.x, b.y + p_height, b.w, b.h - p_height);
+        add_block(p, b.x + p_width, b.y, b.w - p_width, p_height);
+        add_block(p, b.x, b.y + p_height, b.w, b.h - p_height);
     }
-    return b;
+    return true;
 }
-texture & get_texture(bitmap const & p_bitmap) {
-    auto it = textures.find(p_bitmap.id());
-    if (it != textures.end()) {
-        if (!bound) { reinit(); }
-        it->second.last_use = std::chrono::steady_clock::now();
-        return it->second;
+// Finds room on the first page that has it, making a new page or evicting an old one if none do
+std::pair<size_t, block> get_block(GLint p_width, GLint p_height) {
+    if (std::max(p_width, p_height) > config::atlas_size) {
+        throw std::runtime_error{"Texture is too big"};
+    }
+    if (p_width <= 0 || p_height <= 0) { throw std::runtime_error{"Invalid texture size"}; }
+    block b;
+    for (auto i = 0u; i < pages.size(); ++i) {
+        if (get_block(pages[i], p_width, p_height, b)) { return {i, b}; }
     }
+    auto p = pages.size();
+    if (p < static_cast<size_t>(std::max(config::atlas_pages, 1))) {
+        add_page();
+    } else { p = evict(); }
+    get_block(pages[p], p_width, p_height, b);
+    return {p, b};
+}
+// Puts the pixels of a bitmap somewhere in the atlas
+texture & store(bitmap const & p_bitmap, void const * pixels) {
     auto bl = get_block(p_bitmap.width(), p_bitmap.height());
-    if (!bound) { reinit(); }
-    glTexSubImage2D(GL_TEXTURE_2D, 0, bl.x, bl.y, p_bitmap.width(), p_bitmap.height(), GL_BGRA,
-                    GL_UNSIGNED_INT_8_8_8_8_REV, p_bitmap.data());
+    if (bound && bl.first != current) { sprite::flush(); }
+    glBindTexture(GL_TEXTURE_2D, pages[bl.first].id);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, bl.second.x, bl.second.y, p_bitmap.width(),
+                    p_bitmap.height(), GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, pixels);
+    ++counts.uploads;
     auto & tex = textures[p_bitmap.id()];
     auto sf = static_cast<GLfloat>(config::atlas_size);
-    tex.left = bl.x / sf;
-    tex.right = (bl.x + p_bitmap.width()) / sf;
-    tex.top = bl.y / sf;
-    tex.bottom = (bl.y + p_bitmap.height()) / sf;
-    tex.last_use = std::chrono::steady_clock::now();
+    tex.left = bl.second.x / sf;
+    tex.right = (bl.second.x + p_bitmap.width()) / sf;
+    tex.top = bl.second.y / sf;
+    tex.bottom = (bl.second.y + p_bitmap.height()) / sf;
+    tex.x = static_cast<GLushort>(bl.second.x);
+    tex.y = static_cast<GLushort>(bl.second.y);
+    tex.page = bl.first;
     return tex;
 }
+// Returns null while the bitmap is still being decoded
+texture * get_texture(bitmap const & p_bitmap) {
+    auto it = textures.find(p_bitmap.id());
+    if (it == textures.end()) {
+        if (config::async_textures && p_bitmap.length() >= async_size) {
+            stream::request(p_bitmap);
+            if (record) { record->complete = false; }
+            return nullptr;
+        }
+        store(p_bitmap, p_bitmap.data());
+        it = textures.find(p_bitmap.id());
+    }
+    auto & tex = it->second;
+    if (record) {
+        if (record->groups.empty() || record->groups.back().first != tex.page) {
+            record->groups.emplace_back(tex.page, 0);
+        }
+        tex.last_use = std::chrono::steady_clock::now();
+        return &tex;
+    }
+    // A batch draws from a single page, so switching pages ends it
+    if (bound && tex.page != current) { sprite::flush(); }
+    current = tex.page;
+    if (!bound) { reinit(); }
+    tex.last_use = std::chrono::steady_clock::now();
+    return &tex;
+}
+// wztonx already swaps the bitmap a source points at into the frame itself, so only files
+// converted before it did that still need the path looked up
+node frame_bitmap(node n) {
+    auto source = n["source"];
+    if (!source || source.data_type() == node::type::bitmap) return n;
+    std::string str = source;
+    auto b = n.root().resolve(str.substr(str.find_first_of('/') + 1));
+    return b.data_type() == node::type::bitmap ? b : n;
+}
+}
+struct sprite::animation {
+    struct frame {
+        // Borrowed from an earlier frame if this one has none of its own
+        bitmap bit;
+        bool own;
+        int originx, originy;
+        double delay;
+        double a0, a1;
+        // Whether the frame says how to move, rather than moving like the frame before it
+        bool moves;
+        int movetype;
+        double movew, moveh, movep, mover;
+        bool repeat;
+    };
+    std::vector<frame> frames;
+    bool animated;
+};
+namespace {
+// Sprites of the same node share one animation, and nodes live as long as their files. Maps are
+// loaded on another thread, so sprites can be made on more than one
+std::map<node, sprite::animation> animations;
+std::mutex animations_mutex;
+sprite::animation read_animation(node o) {
+    sprite::animation a;
+    a.animated = o.data_type() != node::type::bitmap;
+    auto last_valid = 0;
+    for (auto i = 0; a.animated ? static_cast<bool>(o[i]) : i == 0; ++i) {
+        auto const n = a.animated ? o[i] : o;
+        sprite::animation::frame f{};
+        f.delay = n["delay"].get_real(100);
+        f.bit = frame_bitmap(n);
+        f.own = static_cast<bool>(f.bit);
+        if (f.own) {
+            last_valid = i;
+        } else if (i != 0) {
+            // Frames without a bitmap of their own show one from before them
+            auto const & from = a.frames[static_cast<size_t>(i % (last_valid + 1))];
+            if (from.own) { f.bit = from.bit; }
+        }
+        if (f.bit) {
+            auto const origin = n["origin"];
+            f.originx = origin.x();
+            f.originy = origin.y();
+            if (n["moveType"]) {
+                f.moves = true;
+                f.movetype = n["moveType"];
+                f.movew = n["moveW"];
+                f.moveh = n["moveH"];
+                f.movep = n["moveP"].get_real(1000 * tau);
+                f.mover = n["moveR"];
+            }
+            f.repeat = n["repeat"].get_bool();
+            if (n["a0"] || n["a1"]) {
+                f.a0 = n["a0"].get_real(0) / 255.;
+                f.a1 = n["a1"].get_real(0) / 255.;
+            } else {
+                f.a0 = 1;
+                f.a1 = 1;
+            }
+        }
+        a.frames.push_back(f);
+    }
+    return a;
+}
 }
 void sprite::init() {
-    log << "Using an atlas size of " << config::atlas_size << std::endl;
+    log << "Using an atlas size of " << config::atlas_size << " with up to "
+        << config::atlas_pages << " pages" << std::endl;
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glGenTextures(1, &atlas);
-    glBindTexture(GL_TEXTURE_2D, atlas);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_SRGB8_ALPHA8, config::atlas_size, config::atlas_size, 0, GL_BGRA,
-                 GL_UNSIGNED_INT_8_8_8_8_REV, nullptr);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    reset_blocks();
+    add_page();
+    if (GLEW_VERSION_3_3) { link(); }
+    if (program) {
+        log << "Drawing sprites as instances" << std::endl;
+        stride = sizeof(instance);
+    }
     glGenBuffers(1, &vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    if (GLEW_ARB_buffer_storage && GLEW_ARB_sync) {
+        auto const flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        auto const size = static_cast<GLsizeiptr>(ring_size * stride);
+        glBufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+        ring = static_cast<char *>(glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags));
+    } else { heap.resize(ring_size * stride); }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    if (!program) {
+        // Every batch uses the same indices, two triangles for each group of four vertices
+        std::vector<GLushort> indices(batch_quads * 6);
+        for (auto i = 0u; i < batch_quads; ++i) {
+            auto const q = &indices[i * 6];
+            q[0] = q[3] = static_cast<GLushort>(i * 4);
+            q[1] = static_cast<GLushort>(i * 4 + 1);
+            q[2] = q[4] = static_cast<GLushort>(i * 4 + 2);
+            q[5] = static_cast<GLushort>(i * 4 + 3);
+        }
+        glGenBuffers(1, &ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                     static_cast<GLsizeiptr>(indices.size() * sizeof(GLushort)), indices.data(),
+                     GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+    if (config::async_textures) { stream::init(); }
+}
+void sprite::unload() { stream::unload(); }
+void sprite::upload() {
+    stream::finish([](bitmap const & b, void const * pixels) { store(b, pixels); });
 }
+sprite::counters const & sprite::atlas_counters() { return counts; }
 void sprite::flush() {
     if (bound) {
         bound = false;
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(vertices.size() * sizeof(vertex)),
-                     vertices.data(), GL_STREAM_DRAW);
-        glEnableClientState(GL_COLOR_ARRAY);
-        glEnableClientState(GL_VERTEX_ARRAY);
-        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-        glColorPointer(4, GL_FLOAT, sizeof(vertex),
-                       reinterpret_cast<GLvoid const *>(0 * sizeof(GLfloat)));
-        glVertexPointer(2, GL_FLOAT, sizeof(vertex),
-                        reinterpret_cast<GLvoid const *>(4 * sizeof(GLfloat)));
-        glTexCoordPointer(2, GL_FLOAT, sizeof(vertex),
-                          reinterpret_cast<GLvoid const *>(6 * sizeof(GLfloat)));
-        glDrawArrays(GL_QUADS, 0, static_cast<GLsizei>(vertices.size()));
-        glDisableClientState(GL_COLOR_ARRAY);
-        glDisableClientState(GL_VERTEX_ARRAY);
-        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        submit();
         if (window::get_key(GLFW_KEY_T)) {
             glBlendFunc(GL_SRC_ALPHA, GL_ZERO);
             glBegin(GL_QUADS);
@@ -188,69 +581,55 @@ void sprite::flush() {
         glDisable(GL_TEXTURE_2D);
     }
 }
-sprite::sprite(node o) : data(o) {
-    if (data.data_type() == node::type::bitmap)
-        animated = false;
-    else if (data["0"].data_type() == node::type::bitmap)
-        animated = true;
-    else
-        data = {};
+sprite::sprite(node o) {
+    if (o.data_type() != node::type::bitmap && o["0"].data_type() != node::type::bitmap) return;
+    std::lock_guard<std::mutex> lock{animations_mutex};
+    auto it = animations.find(o);
+    if (it == animations.end()) { it = animations.emplace(o, read_animation(o)).first; }
+    anim = &it->second;
     set_frame(0);
 }
-void sprite::set_frame(int f) {
-    if (!data) return;
-    frame = f;
-    if (!animated) { current = data; } else {
-        current = data[frame];
-        if (!current) current = data[frame = 0];
-        delay = 0;
-        next_delay = current["delay"].get_real(100);
-    }
-    curbit = current;
-    if (current["source"]) {
-        std::string str = current["source"];
-        auto n = current.root().resolve(str.substr(str.find_first_of('/') + 1));
-        if (n.data_type() == node::type::bitmap) curbit = n;
-    }
-    if (!curbit) {
-        if (!animated || frame == 0) { return; }
-        auto actual = data[frame % (last_valid + 1)];
-        curbit = actual;
-        if (actual["source"]) {
-            std::string str = actual["source"];
-            auto n = actual.root().resolve(str.substr(str.find_first_of('/') + 1));
-            if (n.data_type() == node::type::bitmap) curbit = n;
+sprite::box sprite::bounds() const {
+    box b{0, 0, 0, 0};
+    if (!anim) return b;
+    auto movex = 0., movey = 0., radius = 0.;
+    for (auto const & f : anim->frames) {
+        if (!f.own) continue;
+        auto const w = std::max(f.originx, f.bit.width() - f.originx);
+        auto const h = std::max(f.originy, f.bit.height() - f.originy);
+        b.left = std::min(b.left, -w);
+        b.right = std::max(b.right, w);
+        b.top = std::min(b.top, -f.originy);
+        b.bottom = std::max(b.bottom, f.bit.height() - f.originy);
+        // A frame keeps moving the way the last frame that said how did
+        switch (f.moves ? f.movetype : 0) {
+        case 1: movex = std::max(movex, std::abs(f.movew)); break;
+        case 2: movey = std::max(movey, std::abs(f.moveh)); break;
+        case 3: radius = std::max(radius, std::hypot(w, h)); break;
+        default: break;
         }
-        if (!curbit) { return; }
-    } else { last_valid = f; }
-    width = curbit.width();
-    height = curbit.height();
-    auto o = current["origin"];
-    originx = o.x();
-    originy = o.y();
-    if (current["moveType"]) {
-        movetype = current["moveType"];
-        movew = current["moveW"];
-        moveh = current["moveH"];
-        movep = current["moveP"].get_real(1000 * tau);
-        mover = current["moveR"];
-    }
-    repeat = current["repeat"].get_bool();
-    if (current["a0"] || current["a1"]) {
-        a0 = current["a0"].get_real(0) / 255.;
-        a1 = current["a1"].get_real(0) / 255.;
-    } else {
-        a0 = 1;
-        a1 = 1;
     }
+    auto const r = static_cast<int>(std::ceil(radius));
+    auto const mx = static_cast<int>(std::ceil(movex)), my = static_cast<int>(std::ceil(movey));
+    return {std::min(b.left, -r) - mx, std::min(b.top, -r) - my, std::max(b.right, r) + mx,
+            std::max(b.bottom, r) + my};
+}
+void sprite::set_frame(int f) {
+    frame = static_cast<size_t>(f) < anim->frames.size() ? f : 0;
+    delay = 0;
+    if (anim->frames[frame].moves) { motion = frame; }
 }
 void sprite::draw(int x, int y, flags f, int cx, int cy) {
-    if (!data) return;
-    if (animated) {
+    if (!anim) return;
+    if (anim->animated) {
         delay += time::delta * 1000;
-        if (delay > next_delay) set_frame(frame + 1);
+        if (delay > anim->frames[frame].delay) set_frame(frame + 1);
     }
-    if (!curbit) return;
+    auto const & cur = anim->frames[frame];
+    if (!cur.bit) return;
+    auto const width = cur.bit.width(), height = cur.bit.height();
+    auto const originx = cur.originx, originy = cur.originy;
+    auto const movetype = motion < 0 ? 0 : anim->frames[motion].movetype;
     // cx and cy represent tiling distance
     if (!cx)
         cx = width;
@@ -267,16 +646,24 @@ void sprite::draw(int x, int y, flags f, int cx, int cy) {
         x -= originx;
     y -= originy;
     if (f & relative) {
-        x -= view::xmin;
-        y -= view::ymin;
+        x -= record ? record->x : view::xmin;
+        y -= record ? record->y : view::ymin;
     }
     // Handling movetypes
     float angle{0};
     switch (movetype) {
     case 0: break;
-    case 1: x += static_cast<int>(movew * sin(tau * 1000 * time::delta_total / movep)); break;
-    case 2: y += static_cast<int>(moveh * sin(tau * 1000 * time::delta_total / movep)); break;
-    case 3: angle = static_cast<float>(tau * 1000 * time::delta_total / mover); break;
+    case 1: {
+        auto const & m = anim->frames[motion];
+        x += static_cast<int>(m.movew * sin(tau * 1000 * time::delta_total / m.movep));
+    } break;
+    case 2: {
+        auto const & m = anim->frames[motion];
+        y += static_cast<int>(m.moveh * sin(tau * 1000 * time::delta_total / m.movep));
+    } break;
+    case 3:
+        angle = static_cast<float>(tau * 1000 * time::delta_total / anim->frames[motion].mover);
+        break;
     default: log << "Unknown move type: " << movetype << std::endl;
     }
     auto xbegin = x;
@@ -305,16 +692,47 @@ void sprite::draw(int x, int y, flags f, int cx, int cy) {
         yend += view::height;
         if (yend < ybegin) return;
     }
-    if (xend + width < 0) return;
-    if (xbegin > view::width) return;
-    if (yend + height < 0) return;
-    if (ybegin > view::height) return;
+    // Geometry is kept even while out of view
+    if (!record) {
+        if (xend + width < 0) return;
+        if (xbegin > view::width) return;
+        if (yend + height < 0) return;
+        if (ybegin > view::height) return;
+    }
     GLfloat alpha{1};
-    if (animated) {
-        auto dif = delay / next_delay;
-        alpha = static_cast<GLfloat>(dif * a1 + (1 - dif) * a0);
+    if (anim->animated) {
+        auto dif = delay / cur.delay;
+        alpha = static_cast<GLfloat>(dif * cur.a1 + (1 - dif) * cur.a0);
+    }
+    auto tex = get_texture(cur.bit);
+    if (!tex) return;
+    if (program) {
+        instance in{0, 0, static_cast<GLshort>(f & flipped ? -width : width),
+                    static_cast<GLshort>(height),
+                    static_cast<GLshort>(f & flipped ? width - originx : originx),
+                    static_cast<GLshort>(originy), tex->x, tex->y, unorm(view::r),
+                    unorm(view::g), unorm(view::b), unorm(alpha), angle, 1, 1,
+                    static_cast<GLushort>(width), static_cast<GLushort>(height)};
+        // Unless the repeats are rotated or overlap, a single quad can cover all of them
+        if (angle == 0 && cx >= width && cy >= height) {
+            in.x = static_cast<GLshort>(xbegin);
+            in.y = static_cast<GLshort>(ybegin);
+            in.nx = static_cast<GLushort>((xend - xbegin) / cx + 1);
+            in.ny = static_cast<GLushort>((yend - ybegin) / cy + 1);
+            in.cx = static_cast<GLushort>(cx);
+            in.cy = static_cast<GLushort>(cy);
+            std::memcpy(quad(), &in, sizeof(in));
+            return;
+        }
+        for (x = xbegin; x <= xend; x += cx) {
+            for (y = ybegin; y <= yend; y += cy) {
+                in.x = static_cast<GLshort>(x);
+                in.y = static_cast<GLshort>(y);
+                std::memcpy(quad(), &in, sizeof(in));
+            }
+        }
+        return;
     }
-    auto & tex = get_texture(curbit);
     std::array<std::complex<float>, 4> vex;
     if (angle != 0) {
         vex = {{{static_cast<float>(f & flipped ? originx - width : 0 - originx),
@@ -345,17 +763,86 @@ void sprite::draw(int x, int y, flags f, int cx, int cy) {
             std::complex<float> pos{static_cast<float>(x), static_cast<float>(y)};
             auto tvex = vex;
             for (auto & v : tvex) { v += pos; }
-            vertices.push_back({view::r, view::g, view::b, alpha, tvex[0].real(), tvex[0].imag(),
-                                f & flipped ? tex.right : tex.left, tex.top});
-            vertices.push_back({view::r, view::g, view::b, alpha, tvex[1].real(), tvex[1].imag(),
-                                f & flipped ? tex.left : tex.right, tex.top});
-            vertices.push_back({view::r, view::g, view::b, alpha, tvex[2].real(), tvex[2].imag(),
-                                f & flipped ? tex.left : tex.right, tex.bottom});
-            vertices.push_back({view::r, view::g, view::b, alpha, tvex[3].real(), tvex[3].imag(),
-                                f & flipped ? tex.right : tex.left, tex.bottom});
+            auto const q = reinterpret_cast<vertex *>(quad());
+            q[0] = {view::r, view::g, view::b, alpha, tvex[0].real(), tvex[0].imag(),
+                    f & flipped ? tex->right : tex->left, tex->top};
+            q[1] = {view::r, view::g, view::b, alpha, tvex[1].real(), tvex[1].imag(),
+                    f & flipped ? tex->left : tex->right, tex->top};
+            q[2] = {view::r, view::g, view::b, alpha, tvex[2].real(), tvex[2].imag(),
+                    f & flipped ? tex->left : tex->right, tex->bottom};
+            q[3] = {view::r, view::g, view::b, alpha, tvex[3].real(), tvex[3].imag(),
+                    f & flipped ? tex->right : tex->left, tex->bottom};
         }
     }
 }
+bool sprite::still() const {
+    return !anim || (!anim->animated && (motion < 0 || anim->frames[motion].movetype == 0));
+}
+geometry::geometry(geometry && o)
+    : buffer(o.buffer), groups(std::move(o.groups)), generation(o.generation), r(o.r), g(o.g),
+      b(o.b), complete(o.complete) {
+    o.buffer = 0;
+}
+geometry & geometry::operator=(geometry && o) {
+    std::swap(buffer, o.buffer);
+    groups = std::move(o.groups);
+    generation = o.generation;
+    r = o.r, g = o.g, b = o.b;
+    complete = o.complete;
+    return *this;
+}
+geometry::~geometry() {
+    if (buffer) { glDeleteBuffers(1, &buffer); }
+}
+void geometry::draw(int x, int y, std::function<void()> const & make) {
+    // Colours are part of each quad, so rave mode makes them go stale too
+    if (!complete || generation != nl::generation || r != view::r || g != view::g
+        || b != view::b) {
+        recording rec{{}, {}, x, y, true};
+        generation = nl::generation;
+        record = &rec;
+        make();
+        record = nullptr;
+        r = view::r, g = view::g, b = view::b;
+        // Making the quads emptied a page some of them use, so the atlas is too small to hold
+        // them all and they have to be drawn the usual way
+        if (generation != nl::generation) {
+            complete = false;
+            groups.clear();
+            make();
+            return;
+        }
+        complete = rec.complete;
+        groups = std::move(rec.groups);
+        if (!buffer) { glGenBuffers(1, &buffer); }
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(rec.data.size()), rec.data.data(),
+                     GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    if (groups.empty()) { return; }
+    sprite::flush();
+    reinit();
+    bound = false;
+    glTranslatef(static_cast<GLfloat>(x - view::xmin), static_cast<GLfloat>(y - view::ymin), 0);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    auto const now = std::chrono::steady_clock::now();
+    auto offset = size_t{0};
+    for (auto const & group : groups) {
+        glBindTexture(GL_TEXTURE_2D, pages[group.first].id);
+        pages[group.first].last_use = now;
+        for (auto done = size_t{0}; done < group.second; done += batch_quads) {
+            auto const n = std::min(batch_quads, group.second - done);
+            if (program) {
+                draw_instances(offset, n);
+            } else { draw_vertices(offset, n); }
+            offset += n * stride;
+        }
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glLoadIdentity();
+    glDisable(GL_TEXTURE_2D);
+}
 sprite::flags & operator|=(sprite::flags & a, sprite::flags b) {
     return a = static_cast<sprite::flags>(static_cast<unsigned>(a) | static_cast<unsigned>(b));
 }
@@ -19,29 +19,67 @@
 #pragma once
 #include <nx/node.hpp>
 #include <nx/bitmap.hpp>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
 
 namespace nl {
 class sprite {
 public:
     enum flags : unsigned { none = 0x0, relative = 0x1, flipped = 0x2, tilex = 0x4, tiley = 0x8 };
     sprite() = default;
+    // A rectangle relative to where a sprite is drawn
+    struct box {
+        int left, top, right, bottom;
+    };
     sprite(node);
     void draw(int x, int y, flags f, int cx = 0, int cy = 0);
+    // Covers every frame, whether flipped or not and however it moves, but ignores tiling
+    box bounds() const;
+    // Whether the sprite looks the same every frame, so its quads can be kept around
+    bool still() const;
     static void init();
+    static void unload();
     static void flush();
+    // Moves bitmaps that finished decoding in the background into the atlas
+    static void upload();
+    // Textures uploaded to and evicted from the atlas, and pages emptied to make room
+    struct counters {
+        unsigned long long uploads, evictions, wipes;
+    };
+    static counters const & atlas_counters();
+
+    // Everything about the frames of a node, read once and shared by all its sprites
+    struct animation;
 
 private:
     void set_frame(int f);
-    node data, current;
-    bitmap curbit;
-    double delay, next_delay;
-    double movew, moveh, movep, mover;
-    double a0, a1;
-    int movetype{0};
-    int frame, last_valid{0};
-    int originx, originy;
-    int width, height;
-    bool repeat, animated;
+    animation const * anim{nullptr};
+    double delay{0};
+    int frame{0};
+    // The last frame that said how to move, which keeps applying to the frames after it
+    int motion{-1};
+};
+// Quads of still sprites, kept on the GPU instead of being made every frame
+class geometry {
+public:
+    geometry() = default;
+    geometry(geometry &&);
+    geometry & operator=(geometry &&);
+    ~geometry();
+    // Draws the quads of the sprites the function draws, treating x, y as the top left of the
+    // view for relative sprites. The function is only called again once those quads go stale,
+    // such as when the atlas moves their bitmaps
+    void draw(int x, int y, std::function<void()> const &);
+
+private:
+    unsigned buffer{0};
+    // How many quads use each page of the atlas, in order
+    std::vector<std::pair<size_t, size_t>> groups;
+    uint64_t generation{0};
+    float r{0}, g{0}, b{0};
+    bool complete{false};
 };
 sprite::flags & operator|=(sprite::flags &, sprite::flags);
 sprite::flags operator|(sprite::flags, sprite::flags);
@@ -0,0 +1,194 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeClient - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+
+#include "stream.hpp"
+#include "log.hpp"
+#include <GL/glew.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace nl {
+namespace stream {
+namespace {
+// Bitmaps are decoded into a ring of this many bytes when it can be persistently mapped
+size_t const ring_size{32 << 20};
+// How much to upload each frame, so a burst of new bitmaps is spread over several frames
+size_t const frame_budget{8 << 20};
+size_t const none{static_cast<size_t>(-1)};
+struct job {
+    bitmap bmp;
+    // Where in the ring the pixels go, or none when they go in heap instead
+    size_t offset;
+    std::vector<char> heap;
+    // Set when decoding threw, which is logged once it gets back to the main thread
+    std::string error;
+    std::atomic<bool> decoded{false};
+    bool uploaded{false};
+    uint64_t frame{0};
+};
+std::mutex mutex;
+std::condition_variable wake;
+std::deque<job *> queue;
+bool quit{false};
+std::vector<std::thread> workers;
+// Every job not yet retired, in the order they were requested
+std::deque<std::unique_ptr<job>> jobs;
+std::unordered_set<size_t> requested;
+GLuint pbo{};
+char * mapped{nullptr};
+size_t head{0};
+// Each frame that uploaded from the ring has a fence, so its part of the ring is reused only
+// once the GPU is done reading it
+std::deque<std::pair<uint64_t, GLsync>> fences;
+uint64_t frame{0}, retired{0};
+void work() {
+    for (;;) {
+        job * j;
+        {
+            std::unique_lock<std::mutex> lock{mutex};
+            wake.wait(lock, [] { return quit || !queue.empty(); });
+            if (quit) { return; }
+            j = queue.front();
+            queue.pop_front();
+        }
+        try {
+            auto const l = j->bmp.length();
+            auto const p = j->bmp.data();
+            if (j->offset == none) {
+                j->heap.assign(static_cast<char const *>(p), static_cast<char const *>(p) + l);
+            } else { std::memcpy(mapped + j->offset, p, l); }
+        } catch (std::exception const & e) { j->error = e.what(); }
+        j->decoded.store(true, std::memory_order_release);
+    }
+}
+// Finds room in the ring after the newest job, wrapping around to the start if need be
+size_t allocate(size_t size) {
+    if (!mapped) { return none; }
+    auto first = std::find_if(jobs.begin(), jobs.end(),
+                              [](std::unique_ptr<job> const & j) { return j->offset != none; });
+    if (first == jobs.end()) {
+        head = 0;
+        return size <= ring_size ? head : none;
+    }
+    auto const tail = (*first)->offset;
+    if (head > tail) {
+        if (head + size <= ring_size) { return head; }
+        return size <= tail ? 0 : none;
+    }
+    return head + size <= tail ? head : none;
+}
+}
+void init() {
+    if (GLEW_ARB_buffer_storage && GLEW_ARB_sync) {
+        auto const flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &pbo);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, ring_size, nullptr, flags);
+        mapped = static_cast<char *>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, ring_size, flags));
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    auto const cores = std::thread::hardware_concurrency();
+    auto const count = std::min(std::max(cores, 2u) - 1, 4u);
+    log << "Decoding bitmaps on " << count << " threads"
+        << (mapped ? " into a mapped buffer" : "") << std::endl;
+    for (auto i = 0u; i < count; ++i) { workers.emplace_back(work); }
+}
+void unload() {
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        quit = true;
+    }
+    wake.notify_all();
+    for (auto & w : workers) { w.join(); }
+    workers.clear();
+    queue.clear();
+    for (auto & f : fences) { glDeleteSync(f.second); }
+    fences.clear();
+    jobs.clear();
+    requested.clear();
+    if (mapped) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glDeleteBuffers(1, &pbo);
+        mapped = nullptr;
+    }
+}
+void request(bitmap const & b) {
+    if (!requested.insert(b.id()).second) { return; }
+    std::unique_ptr<job> j{new job{}};
+    j->bmp = b;
+    j->offset = allocate(b.length());
+    if (j->offset != none) { head = j->offset + b.length(); }
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        queue.push_back(j.get());
+    }
+    wake.notify_one();
+    jobs.push_back(std::move(j));
+}
+void finish(std::function<void(bitmap const &, void const *)> const & f) {
+    while (!fences.empty()) {
+        auto const r = glClientWaitSync(fences.front().second, 0, 0);
+        if (r != GL_ALREADY_SIGNALED && r != GL_CONDITION_SATISFIED) { break; }
+        glDeleteSync(fences.front().second);
+        retired = fences.front().first + 1;
+        fences.pop_front();
+    }
+    auto bytes = size_t{0};
+    auto ring = false;
+    for (auto & j : jobs) {
+        if (j->uploaded || !j->decoded.load(std::memory_order_acquire)) { continue; }
+        auto const l = j->bmp.length();
+        // Let at least one through so big bitmaps still make it
+        if (bytes && bytes + l > frame_budget) { continue; }
+        if (!j->error.empty()) {
+            log << "Failed to decode bitmap: " << j->error << std::endl;
+        } else if (j->offset == none) {
+            f(j->bmp, j->heap.data());
+        } else {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+            f(j->bmp, reinterpret_cast<void const *>(j->offset));
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+        ring = ring || j->offset != none;
+        requested.erase(j->bmp.id());
+        std::vector<char>{}.swap(j->heap);
+        j->uploaded = true;
+        j->frame = frame;
+        bytes += l;
+    }
+    if (ring) { fences.emplace_back(frame, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0)); }
+    ++frame;
+    while (!jobs.empty() && jobs.front()->uploaded
+           && (jobs.front()->offset == none || jobs.front()->frame < retired)) {
+        jobs.pop_front();
+    }
+}
+}
+}
@@ -0,0 +1,35 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeClient - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include <nx/bitmap.hpp>
+#include <functional>
+
+namespace nl {
+namespace stream {
+// Starts the decoding threads and maps the staging buffer, if the driver can
+void init();
+void unload();
+// Queues the bitmap to be decoded on a worker, unless it already is
+void request(bitmap const &);
+// Passes each bitmap decoded since the last call, up to a frame's worth of bytes, along with
+// the pixels to give glTexSubImage2D. Those may be an offset into the staging buffer, which is
+// bound as the pixel unpack buffer for just that call
+void finish(std::function<void(bitmap const &, void const *)> const &);
+}
+}
@@ -27,4 +27,9 @@ tile::tile(node n, node dn) {
     spr = nn;
 }
 void tile::render() { spr.draw(x, y, sprite::relative); }
+bool tile::still() const { return spr.still(); }
+sprite::box tile::bounds() const {
+    auto b = spr.bounds();
+    return {x + b.left, y + b.top, x + b.right, y + b.bottom};
+}
 }
@@ -25,6 +25,9 @@ class tile {
 public:
     tile(node, node);
     void render();
+    // Where in the map the tile shows up
+    sprite::box bounds() const;
+    bool still() const;
     int x, y, z;
 
 private:
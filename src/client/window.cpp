@@ -171,11 +171,19 @@ void update() {
         auto now = std::chrono::steady_clock::now();
         if (now - last_title > std::chrono::milliseconds(250)) {
             last_title = now;
-            glfwSetWindowTitle(window, ("NoLifeStory {fps = " + std::to_string(time::fps)
-                                        + "; map = " + map::current_name + ";};").c_str());
+            auto text = "NoLifeStory {fps = " + std::to_string(time::fps)
+                        + "; map = " + map::current_name + ";";
+            if (config::debug) {
+                auto const & c = sprite::atlas_counters();
+                text += " uploads = " + std::to_string(c.uploads) + "; evictions = "
+                        + std::to_string(c.evictions) + "; wipes = " + std::to_string(c.wipes)
+                        + ";";
+            }
+            glfwSetWindowTitle(window, (text + "};").c_str());
         }
     }
     sprite::flush();
+    sprite::upload();
     check_errors();
     glfwPollEvents();
     glfwSwapBuffers(window);
@@ -18,6 +18,12 @@
 
 #include "bitmap.hpp"
 #include <lz4.h>
+#ifndef NL_NO_ZSTD
+#include <zstd.h>
+#endif
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
 #include <vector>
 
 namespace nl {
@@ -25,17 +31,180 @@ bitmap::bitmap(void const * d, uint16_t w, uint16_t h) : m_data(d), m_width(w),
 bool bitmap::operator<(bitmap const & o) const { return m_data < o.m_data; }
 bool bitmap::operator==(bitmap const & o) const { return m_data == o.m_data; }
 bitmap::operator bool() const { return m_data ? true : false; }
-std::vector<char> bitmap_buf;
+// Each thread gets its own buffers so bitmaps can be decoded on several threads at once
+thread_local std::vector<char> bitmap_buf;
+thread_local std::vector<char> bitmap_expand_buf;
+namespace {
+// A bitmap starts with a 32 bit length followed by that much LZ4 data, unless the top bit is set
+// in which case it is a tag. Bits 24-30 of the tag are the codec, bits 16-23 the format, bits 0-3
+// the number of levels and the rest is reserved. The tag is followed by the 32 bit length of the
+// payload, for lz4dict the 64 bit signed offset from the start of the bitmap to the dictionary,
+// which is a 32 bit length followed by the dictionary, then a 64 bit signed offset from the start
+// of the bitmap to each level, and finally the payload.
+uint32_t const tagged = 0x80000000;
+enum class codec : uint32_t { lz4 = 0, raw = 1, zstd = 2, lz4dict = 3 };
+template <typename T>
+T read(char const * p) {
+    T v;
+    std::memcpy(&v, p, sizeof(T));
+    return v;
+}
+// Where the level offsets start
+size_t header(uint32_t tag) {
+    return static_cast<codec>(tag >> 24 & 0x7F) == codec::lz4dict ? 16 : 8;
+}
+// Decodes the 4 colors of a BC color block into BGRA8888
+void color_block(char const * b, bool bc1, uint8_t (&palette)[4][4]) {
+    auto const c0 = read<uint16_t>(b);
+    auto const c1 = read<uint16_t>(b + 2);
+    auto expand = [](unsigned c, uint8_t(&p)[4]) {
+        auto const r = c >> 11 & 0x1F, g = c >> 5 & 0x3F, bl = c & 0x1F;
+        p[0] = static_cast<uint8_t>(bl << 3 | bl >> 2);
+        p[1] = static_cast<uint8_t>(g << 2 | g >> 4);
+        p[2] = static_cast<uint8_t>(r << 3 | r >> 2);
+        p[3] = 255;
+    };
+    expand(c0, palette[0]);
+    expand(c1, palette[1]);
+    for (auto i = 0; i < 3; ++i) {
+        auto const x = palette[0][i], y = palette[1][i];
+        // BC1 switches to three colors and transparent black when the endpoints are swapped
+        if (c0 > c1 || !bc1) {
+            palette[2][i] = static_cast<uint8_t>((2 * x + y) / 3);
+            palette[3][i] = static_cast<uint8_t>((x + 2 * y) / 3);
+        } else {
+            palette[2][i] = static_cast<uint8_t>((x + y) / 2);
+            palette[3][i] = 0;
+        }
+    }
+    palette[2][3] = 255;
+    palette[3][3] = c0 > c1 || !bc1 ? 255 : 0;
+}
+// Expands BC1, BC2 or BC3 blocks into BGRA8888 pixels
+void expand_blocks(bitmap::format f, char const * in, uint8_t * out, int width, int height) {
+    auto const block = f == bitmap::format::bc1 ? 8 : 16;
+    for (auto by = 0; by < height; by += 4) {
+        for (auto bx = 0; bx < width; bx += 4, in += block) {
+            auto const color = f == bitmap::format::bc1 ? in : in + 8;
+            uint8_t palette[4][4];
+            color_block(color, f == bitmap::format::bc1, palette);
+            auto const indices = read<uint32_t>(color + 4);
+            uint8_t alpha[16];
+            if (f == bitmap::format::bc2) {
+                auto const bits = read<uint64_t>(in);
+                for (auto i = 0; i < 16; ++i)
+                    alpha[i] = static_cast<uint8_t>((bits >> i * 4 & 0xF) * 0x11);
+            } else if (f == bitmap::format::bc3) {
+                unsigned const a0 = static_cast<uint8_t>(in[0]), a1 = static_cast<uint8_t>(in[1]);
+                uint8_t values[8] = {static_cast<uint8_t>(a0), static_cast<uint8_t>(a1)};
+                if (a0 > a1) {
+                    for (auto i = 1u; i < 7; ++i)
+                        values[i + 1] = static_cast<uint8_t>(((7 - i) * a0 + i * a1) / 7);
+                } else {
+                    for (auto i = 1u; i < 5; ++i)
+                        values[i + 1] = static_cast<uint8_t>(((5 - i) * a0 + i * a1) / 5);
+                    values[6] = 0;
+                    values[7] = 255;
+                }
+                auto const bits = read<uint64_t>(in) >> 16;
+                for (auto i = 0; i < 16; ++i) alpha[i] = values[bits >> i * 3 & 7];
+            }
+            for (auto i = 0; i < 16; ++i) {
+                auto const x = bx + i % 4, y = by + i / 4;
+                if (x >= width || y >= height) continue;
+                auto const p = out + (static_cast<size_t>(y) * width + x) * 4;
+                std::memcpy(p, palette[indices >> i * 2 & 3], 4);
+                if (f != bitmap::format::bc1) p[3] = alpha[i];
+            }
+        }
+    }
+}
+}
 void const * bitmap::data() const {
-    if (!m_data) return nullptr;
+    auto const raw = raw_data();
+    if (data_format() == format::bgra8888) return raw;
     auto const l = length();
+    if (l > bitmap_expand_buf.size()) bitmap_expand_buf.resize(l);
+    expand_blocks(data_format(), static_cast<char const *>(raw),
+                  reinterpret_cast<uint8_t *>(bitmap_expand_buf.data()), m_width, m_height);
+    return bitmap_expand_buf.data();
+}
+void const * bitmap::raw_data() const {
+    if (!m_data) return nullptr;
+    auto const l = raw_length();
+    auto const p = reinterpret_cast<char const *>(m_data);
+    auto const tag = read<uint32_t>(p);
     if (l + 0x20 > bitmap_buf.size()) bitmap_buf.resize(l + 0x20);
-    ::LZ4_decompress_fast(4 + reinterpret_cast<char const *>(m_data), bitmap_buf.data(),
-                          static_cast<int>(l));
+    if (!(tag & tagged)) {
+        ::LZ4_decompress_fast(p + 4, bitmap_buf.data(), static_cast<int>(l));
+        return bitmap_buf.data();
+    }
+    auto const size = read<uint32_t>(p + 4);
+    auto const payload = p + header(tag) + (tag & 0xF) * 8;
+    auto result = 0ll;
+    switch (static_cast<codec>(tag >> 24 & 0x7F)) {
+    case codec::lz4:
+        result = ::LZ4_decompress_safe(payload, bitmap_buf.data(), static_cast<int>(size),
+                                       static_cast<int>(l));
+        break;
+    case codec::raw:
+        // Already exactly what is wanted, so there's no need to copy it
+        if (size != l) throw std::runtime_error{"Raw bitmap has the wrong size"};
+        return payload;
+    case codec::zstd:
+#ifndef NL_NO_ZSTD
+    {
+        auto const n = ::ZSTD_decompress(bitmap_buf.data(), l, payload, size);
+        result = ::ZSTD_isError(n) ? -1 : static_cast<long long>(n);
+        break;
+    }
+#else
+        throw std::runtime_error{"Bitmap is compressed with zstd which is not supported"};
+#endif
+    case codec::lz4dict: {
+        auto const dict = p + read<int64_t>(p + 8);
+        result = ::LZ4_decompress_safe_usingDict(
+            payload, bitmap_buf.data(), static_cast<int>(size), static_cast<int>(l), dict + 4,
+            static_cast<int>(read<uint32_t>(dict)));
+        break;
+    }
+    default: throw std::runtime_error{"Bitmap has an unknown codec"};
+    }
+    if (result != l) throw std::runtime_error{"Failed to decompress bitmap"};
     return bitmap_buf.data();
 }
+unsigned bitmap::levels() const {
+    if (!m_data) return 0;
+    auto const tag = read<uint32_t>(reinterpret_cast<char const *>(m_data));
+    return tag & tagged ? tag & 0xF : 0;
+}
+bitmap bitmap::level(unsigned n) const {
+    n = std::min(n, levels());
+    if (n == 0) return *this;
+    auto const p = reinterpret_cast<char const *>(m_data);
+    auto const offset = read<int64_t>(p + header(read<uint32_t>(p)) + (n - 1) * 8);
+    auto const round = (1u << n) - 1;
+    return {p + offset, static_cast<uint16_t>((m_width + round) >> n),
+            static_cast<uint16_t>((m_height + round) >> n)};
+}
+bitmap::format bitmap::data_format() const {
+    if (!m_data) return format::bgra8888;
+    auto const tag = read<uint32_t>(reinterpret_cast<char const *>(m_data));
+    if (!(tag & tagged)) return format::bgra8888;
+    return static_cast<format>(tag >> 16 & 0xFF);
+}
 uint16_t bitmap::width() const { return m_width; }
 uint16_t bitmap::height() const { return m_height; }
 uint32_t bitmap::length() const { return 4u * m_width * m_height; }
+uint32_t bitmap::raw_length() const {
+    auto const blocks = ((m_width + 3u) / 4) * ((m_height + 3u) / 4);
+    switch (data_format()) {
+    case format::bgra8888: return length();
+    case format::bc1: return blocks * 8;
+    case format::bc2:
+    case format::bc3: return blocks * 16;
+    }
+    throw std::runtime_error{"Bitmap has an unknown format"};
+}
 size_t bitmap::id() const { return reinterpret_cast<size_t>(m_data); }
 }
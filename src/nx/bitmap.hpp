@@ -24,6 +24,14 @@
 namespace nl {
 class bitmap {
 public:
+    // How the pixels are stored. The block compressed formats are the standard BC1, BC2 and BC3,
+    // which decode to RGBA on the GPU
+    enum class format : uint8_t {
+        bgra8888 = 0,
+        bc1 = 1,
+        bc2 = 2,
+        bc3 = 3,
+    };
     bitmap() = default;
     bitmap(bitmap const &) = default;
     bitmap & operator=(bitmap const &) = default;
@@ -35,11 +43,26 @@ class bitmap {
     // This function decompresses the data on the fly
     // Do not free the pointer returned by this method
     // Every time this function is called
-    // any previous pointers returned by this method become invalid
+    // any previous pointers returned by this method on the same thread become invalid
+    // Different threads decode into different buffers, so they may decode at the same time
+    // Bitmaps stored uncompressed are returned straight from the file
+    // The pixels are always BGRA8888, block compressed formats being expanded
     void const * data() const;
+    // The pixels as stored, so block compressed formats can be uploaded without expanding them
+    // Same rules apply as data()
+    void const * raw_data() const;
+    format data_format() const;
     uint16_t width() const;
     uint16_t height() const;
+    // Length of data()
     uint32_t length() const;
+    // Length of raw_data()
+    uint32_t raw_length() const;
+    // How many smaller versions of the bitmap are stored, each half the size of the one before
+    // rounding up
+    unsigned levels() const;
+    // The bitmap scaled down by 2^n, or the smallest one stored if there aren't that many levels
+    bitmap level(unsigned n) const;
     // Returns a unique id, useful for keeping track of what bitmaps you loaded
     size_t id() const;
 
@@ -87,6 +87,9 @@ void file::open(std::string name) {
     if (reinterpret_cast<intptr_t>(m_data->base) == -1)
         throw std::runtime_error("Failed to create memory mapping of file " + name);
 #endif
+    auto slash = name.find_last_of("/\\");
+    m_data->name = slash == std::string::npos ? name : name.substr(slash + 1);
+    m_data->name = m_data->name.substr(0, m_data->name.find_last_of('.'));
     m_data->header = reinterpret_cast<header const *>(m_data->base);
     if (m_data->header->magic != 0x34474B50)
         throw std::runtime_error(name + " is not a PKG4 NX file");
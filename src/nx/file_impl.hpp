@@ -19,6 +19,7 @@
 #pragma once
 #include "file.hpp"
 #include "node_impl.hpp"
+#include <string>
 
 namespace nl {
 #pragma pack(push, 1)
@@ -41,6 +42,8 @@ struct _file_data {
     uint64_t const * bitmap_table = nullptr;
     uint64_t const * audio_table = nullptr;
     file::header const * header = nullptr;
+    // The file name without its directory or extension
+    std::string name;
 #ifdef _WIN32
     void * file_handle = nullptr;
     void * map = nullptr;
@@ -18,6 +18,7 @@
 
 #include "node_impl.hpp"
 #include "file_impl.hpp"
+#include "trace_impl.hpp"
 #include "bitmap.hpp"
 #include "audio.hpp"
 #include <cstring>
@@ -30,6 +31,8 @@ node::node(node const & o) : m_data(o.m_data), m_file(o.m_file) {}
 node::node(data const * d, file::data const * f) : m_data(d), m_file(f) {}
 node node::begin() const {
     if (!m_data) return {nullptr, m_file};
+    if (m_data->num && trace::active.load(std::memory_order_relaxed))
+        trace::touch_node(m_file, m_file->node_table + m_data->children);
     return {m_file->node_table + m_data->children, m_file};
 }
 node node::end() const {
@@ -181,8 +184,10 @@ node node::get_child(char const * const o, uint16_t const l) const {
             p = p2 + 1, n -= n2 + 1;
         else if (l1 > l)
             n = n2;
-        else
+        else {
+            if (trace::active.load(std::memory_order_relaxed)) trace::touch_node(m_file, p2);
             return {p2, m_file};
+        }
     }
 }
 int64_t node::to_integer() const { return m_data->ireal; }
@@ -194,6 +199,7 @@ std::string node::to_string() const {
 }
 vector2i node::to_vector() const { return {m_data->vector[0], m_data->vector[1]}; }
 bitmap node::to_bitmap() const {
+    if (trace::active.load(std::memory_order_relaxed)) trace::touch_bitmap(m_file, m_data);
     return {reinterpret_cast<char const *>(m_file->base)
                 + m_file->bitmap_table[m_data->bitmap.index],
             m_data->bitmap.width, m_data->bitmap.height};
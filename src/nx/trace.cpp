@@ -0,0 +1,108 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeNx - Part of the NoLifeStory project                               //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+#include "trace.hpp"
+#include "trace_impl.hpp"
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace nl {
+namespace trace {
+std::atomic<bool> active{false};
+namespace {
+struct event {
+    int64_t time;
+    file::data const * source;
+    uint32_t node;
+    bool bitmap;
+};
+// What has been used so far in a file, by node index
+struct usage {
+    std::vector<bool> nodes;
+    std::vector<bool> bitmaps;
+};
+std::mutex mutex;
+std::chrono::steady_clock::time_point started;
+std::vector<event> events;
+std::unordered_map<file::data const *, usage> files;
+void record(file::data const * f, node::data const * n, bool bitmap) {
+    std::lock_guard<std::mutex> lock{mutex};
+    if (!active) return;
+    auto index = static_cast<uint32_t>(n - f->node_table);
+    auto & u = files[f];
+    auto & used = bitmap ? u.bitmaps : u.nodes;
+    if (used.empty()) used.resize(f->header->node_count);
+    if (used[index]) return;
+    used[index] = true;
+    auto time = std::chrono::steady_clock::now() - started;
+    events.push_back(
+        {std::chrono::duration_cast<std::chrono::microseconds>(time).count(), f, index, bitmap});
+}
+std::string name_of(file::data const * f, node::data const & n) {
+    auto const s = reinterpret_cast<char const *>(f->base) + f->string_table[n.name];
+    return {s + 2, *reinterpret_cast<uint16_t const *>(s)};
+}
+// Works out the paths of everything that was used. Children shared through UOLs are only walked
+// the first time they are found, which also keeps UOLs pointing at their parents from looping.
+void find_paths(file::data const * f, usage const & u, uint32_t index, std::string const & path,
+                std::vector<bool> & walked, std::unordered_map<uint32_t, std::string> & paths) {
+    auto & n = f->node_table[index];
+    if (n.num == 0 || walked[n.children]) return;
+    walked[n.children] = true;
+    for (auto i = n.children; i < n.children + n.num; ++i) {
+        auto child = path.empty() ? name_of(f, f->node_table[i])
+                                  : path + '/' + name_of(f, f->node_table[i]);
+        if ((!u.nodes.empty() && u.nodes[i]) || (!u.bitmaps.empty() && u.bitmaps[i]))
+            paths.emplace(i, child);
+        find_paths(f, u, i, child, walked, paths);
+    }
+}
+}
+void touch_node(file::data const * f, node::data const * n) { record(f, n, false); }
+void touch_bitmap(file::data const * f, node::data const * n) { record(f, n, true); }
+void start() {
+    std::lock_guard<std::mutex> lock{mutex};
+    events.clear();
+    files.clear();
+    started = std::chrono::steady_clock::now();
+    active = true;
+}
+void stop(std::string const & path) {
+    std::lock_guard<std::mutex> lock{mutex};
+    active = false;
+    std::unordered_map<file::data const *, std::unordered_map<uint32_t, std::string>> paths;
+    for (auto & it : files) {
+        std::vector<bool> walked(it.first->header->node_count);
+        find_paths(it.first, it.second, 0, {}, walked, paths[it.first]);
+    }
+    std::ofstream out{path};
+    if (!out.is_open()) throw std::runtime_error("Failed to open trace " + path);
+    out << "nxtrace 1\n";
+    for (auto & e : events) {
+        out << e.time << (e.bitmap ? " bitmap " : " node ") << e.source->name << ' '
+            << paths[e.source][e.node] << '\n';
+    }
+    events.clear();
+    files.clear();
+}
+bool recording() { return active; }
+}
+}
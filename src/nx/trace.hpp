@@ -0,0 +1,34 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeNx - Part of the NoLifeStory project                               //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <string>
+
+namespace nl {
+// Records the first time each node is looked up and each bitmap is taken from a node, across every
+// open file, so wztonx --order can lay files out in the order they actually get used
+namespace trace {
+void start();
+// Stops recording and writes the trace to a file. After a first line of "nxtrace 1" there is one
+// line per use, in the order they happened:
+//   <microseconds since start> <node|bitmap> <file> <path>
+// where file is the name of the NX file without its directory or extension. Must be called before
+// any of the files involved are closed.
+void stop(std::string const & path);
+bool recording();
+}
+}
@@ -0,0 +1,120 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeWzToNx - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+#include "cache.hpp"
+
+#include <cstring>
+#include <fstream>
+
+namespace nl {
+namespace cache {
+namespace {
+uint64_t const prime1 = 0x9E3779B185EBCA87ull;
+uint64_t const prime2 = 0xC2B2AE3D27D4EB4Full;
+uint64_t const prime3 = 0x165667B19E3779F9ull;
+uint64_t const prime4 = 0x85EBCA77C2B2AE63ull;
+uint64_t const prime5 = 0x27D4EB2F165667C5ull;
+uint64_t rotl(uint64_t x, int r) { return x << r | x >> (64 - r); }
+uint64_t read64(unsigned char const * p) {
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    return v;
+}
+uint32_t read32(unsigned char const * p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+uint64_t round(uint64_t acc, uint64_t input) {
+    acc += input * prime2;
+    acc = rotl(acc, 31);
+    return acc * prime1;
+}
+uint64_t merge(uint64_t acc, uint64_t val) {
+    acc ^= round(0, val);
+    return acc * prime1 + prime4;
+}
+// Bumped whenever the format of the manifest changes
+char const magic[] = "nxcache 4";
+}
+uint64_t hash(void const * data, size_t size, uint64_t seed) {
+    auto p = static_cast<unsigned char const *>(data);
+    auto end = p + size;
+    uint64_t h;
+    if (size >= 32) {
+        uint64_t v1 = seed + prime1 + prime2, v2 = seed + prime2, v3 = seed, v4 = seed - prime1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(h, v1);
+        h = merge(h, v2);
+        h = merge(h, v3);
+        h = merge(h, v4);
+    } else {
+        h = seed + prime5;
+    }
+    h += size;
+    for (; p + 8 <= end; p += 8) h = rotl(h ^ round(0, read64(p)), 27) * prime1 + prime4;
+    if (p + 4 <= end) {
+        h = rotl(h ^ read32(p) * prime1, 23) * prime2 + prime3;
+        p += 4;
+    }
+    for (; p < end; ++p) h = rotl(h ^ *p * prime5, 11) * prime1;
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
+bool manifest::load(std::string const & path, bool with_bitmaps) {
+    std::ifstream file{path};
+    std::string line;
+    if (!std::getline(file, line) || line != magic) return false;
+    std::string word;
+    size_t count = 0;
+    file >> word >> std::hex >> input >> word >> output >> word >> std::dec >> client >> word >> hc
+        >> word >> codec >> word >> std::hex >> filter >> word >> order >> word >> std::dec
+        >> count;
+    if (!file) return false;
+    bitmaps.clear();
+    if (!with_bitmaps) return true;
+    bitmaps.reserve(count);
+    for (auto i = size_t{0}; i < count; ++i) {
+        uint64_t h;
+        blob b;
+        file >> std::hex >> h >> std::dec >> b.offset >> b.size;
+        if (!file) return false;
+        bitmaps[h] = b;
+    }
+    return true;
+}
+void manifest::save(std::string const & path) const {
+    std::ofstream file{path};
+    file << magic << '\n' << std::hex << "input " << input << "\noutput " << output << std::dec
+         << "\nclient " << client << "\nhc " << hc << "\ncodec " << codec << "\nfilter " << std::hex
+         << filter << "\norder " << order << std::dec << "\nbitmaps " << bitmaps.size() << '\n';
+    for (auto const & b : bitmaps)
+        file << std::hex << b.first << ' ' << std::dec << b.second.offset << ' ' << b.second.size
+             << '\n';
+}
+}
+}
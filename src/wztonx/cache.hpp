@@ -0,0 +1,54 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeWzToNx - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+namespace nl {
+namespace cache {
+// xxHash64 of a buffer
+uint64_t hash(void const * data, size_t size, uint64_t seed = 0);
+// Where a compressed bitmap lives in an NX file, including its header
+struct blob {
+    uint64_t offset;
+    uint64_t size;
+};
+// The .nxcache file kept next to each NX file, recording what it was made from so unchanged
+// files can be skipped and unchanged canvases don't have to be compressed again
+struct manifest {
+    uint64_t input = 0;
+    uint64_t output = 0;
+    bool client = false;
+    bool hc = false;
+    // The codec policy bitmaps were written with
+    std::string codec = "lz4";
+    // Hash of the rules for which nodes were left out, 0 if there weren't any
+    uint64_t filter = 0;
+    // Hash of the trace the file was laid out by, 0 if there wasn't one
+    uint64_t order = 0;
+    // Keyed by the hash of the source canvas
+    std::unordered_map<uint64_t, blob> bitmaps;
+    // Returns false if there is no usable manifest at that path. The bitmaps can be left out,
+    // since there can be a lot of them.
+    bool load(std::string const & path, bool with_bitmaps = true);
+    void save(std::string const & path) const;
+};
+}
+}
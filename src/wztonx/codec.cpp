@@ -0,0 +1,205 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeWzToNx - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+#include "codec.hpp"
+
+#ifndef NL_NO_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace nl {
+namespace codec {
+namespace {
+// Set in the first word of a blob when it is a tag rather than the length of legacy LZ4 data
+uint32_t const tagged = 0x80000000;
+struct entry {
+    char const * name;
+    policy p;
+};
+entry const policies[] = {{"lz4", policy::lz4},
+                          {"zstd", policy::zstd},
+                          {"lz4dict", policy::lz4dict},
+                          {"raw", policy::raw},
+                          {"auto", policy::automatic}};
+void put32(uint8_t * p, uint32_t v) { std::memcpy(p, &v, 4); }
+id codec_of(uint32_t tag) { return static_cast<id>(tag >> 24 & 0x7F); }
+// Where the level offsets start, after the tag, the length and the dictionary offset if any
+size_t header(id codec) { return codec == id::lz4dict ? 16 : 8; }
+}
+size_t length(format f, int32_t width, int32_t height) {
+    auto blocks = static_cast<size_t>((width + 3) / 4) * static_cast<size_t>((height + 3) / 4);
+    switch (f) {
+    case format::bgra8888: return static_cast<size_t>(width) * static_cast<size_t>(height) * 4;
+    case format::bc1: return blocks * 8;
+    case format::bc2:
+    case format::bc3: return blocks * 16;
+    }
+    throw std::runtime_error{"Unknown bitmap format"};
+}
+unsigned levels(int32_t width, int32_t height, unsigned most) {
+    if (width <= 0 || height <= 0) return 0;
+    auto n = 0u;
+    for (; n < std::min(most, max_levels) && (width > 1 || height > 1); ++n) {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+    }
+    return n;
+}
+bool parse(std::string const & name, policy & p) {
+    for (auto & e : policies) {
+        if (name != e.name) continue;
+#ifdef NL_NO_ZSTD
+        if (e.p == policy::zstd) return false;
+#endif
+        p = e.p;
+        return true;
+    }
+    return false;
+}
+char const * name(policy p) {
+    for (auto & e : policies)
+        if (e.p == p) return e.name;
+    return "unknown";
+}
+bool uses_dictionary(policy p) { return p == policy::lz4dict || p == policy::automatic; }
+std::vector<char> train(std::vector<uint8_t> const & samples, std::vector<size_t> const & sizes) {
+    // With this little to go on the dictionary would cost more space than it saves
+    if (samples.size() < dictionary_size * 4) return {};
+#ifndef NL_NO_ZSTD
+    std::vector<char> dictionary(dictionary_size);
+    auto trained = ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(), samples.data(),
+                                         sizes.data(), static_cast<unsigned>(sizes.size()));
+    if (!ZDICT_isError(trained)) {
+        dictionary.resize(trained);
+        return dictionary;
+    }
+#else
+    static_cast<void>(sizes);
+#endif
+    // Too few samples to train on, so settle for the tail end of them as is
+    auto size = std::min(samples.size(), dictionary_size);
+    return {samples.end() - static_cast<ptrdiff_t>(size), samples.end()};
+}
+bool relocatable(void const * blob) {
+    uint32_t tag;
+    std::memcpy(&tag, blob, 4);
+    return !(tag & tagged) || (codec_of(tag) != id::lz4dict && (tag & 0xF) == 0);
+}
+void link(std::vector<uint8_t> & blob, unsigned level, int64_t offset) {
+    uint32_t tag;
+    std::memcpy(&tag, blob.data(), 4);
+    std::memcpy(blob.data() + header(codec_of(tag)) + (level - 1) * 8, &offset, 8);
+}
+encoder::encoder(policy p, bool hc, int level, std::vector<char> const & dictionary)
+    : m_policy(p), m_hc(hc), m_level(level), m_dictionary(dictionary) {
+    if (m_dictionary.empty()) return;
+    if (m_hc) m_stream_hc = LZ4_createStreamHC();
+    else m_stream = LZ4_createStream();
+}
+encoder::~encoder() {
+    if (m_stream) LZ4_freeStream(m_stream);
+    if (m_stream_hc) LZ4_freeStreamHC(m_stream_hc);
+}
+id encoder::choose(size_t size) const {
+    switch (m_policy) {
+    case policy::lz4: return id::lz4;
+    case policy::zstd: return id::zstd;
+    case policy::lz4dict: return m_dictionary.empty() ? id::lz4 : id::lz4dict;
+    case policy::raw: return id::raw;
+    case policy::automatic:
+        // Small sprites are the ones drawn constantly, so they get the fastest decode
+        if (size <= small_bitmap) return m_dictionary.empty() ? id::lz4 : id::lz4dict;
+#ifdef NL_NO_ZSTD
+        return id::lz4;
+#else
+        return id::zstd;
+#endif
+    }
+    return id::lz4;
+}
+size_t encoder::compress(id codec, uint8_t const * pixels, size_t size, uint8_t * out) {
+    auto in = reinterpret_cast<char const *>(pixels);
+    auto dst = reinterpret_cast<char *>(out);
+    auto isize = static_cast<int>(size);
+    auto bound = LZ4_compressBound(isize);
+    auto dsize = static_cast<int>(m_dictionary.size());
+    switch (codec) {
+    case id::lz4:
+        return static_cast<size_t>(m_hc ? LZ4_compressHC(in, dst, isize)
+                                        : LZ4_compress(in, dst, isize));
+    case id::raw: std::memcpy(out, pixels, size); return size;
+    case id::lz4dict:
+        // Loading the dictionary again each time keeps every bitmap independent of the last
+        if (m_hc) {
+            LZ4_loadDictHC(m_stream_hc, m_dictionary.data(), dsize);
+            return static_cast<size_t>(LZ4_compress_HC_continue(m_stream_hc, in, dst, isize, bound));
+        }
+        LZ4_loadDict(m_stream, m_dictionary.data(), dsize);
+        return static_cast<size_t>(LZ4_compress_fast_continue(m_stream, in, dst, isize, bound, 1));
+    case id::zstd: {
+#ifndef NL_NO_ZSTD
+        auto n = ZSTD_compress(out, ZSTD_compressBound(size), pixels, size, m_level);
+        if (ZSTD_isError(n)) throw std::runtime_error{"zstd failed to compress a bitmap"};
+        return n;
+#else
+        throw std::runtime_error{"zstd is not supported by this build"};
+#endif
+    }
+    }
+    throw std::runtime_error{"Unknown bitmap codec"};
+}
+void encoder::encode(format f, uint8_t const * pixels, size_t size, int64_t dictionary,
+                     unsigned levels, std::vector<uint8_t> & blob) {
+    auto bound = [&](id codec) {
+        if (codec == id::raw) return size;
+#ifndef NL_NO_ZSTD
+        if (codec == id::zstd) return ZSTD_compressBound(size);
+#endif
+        return static_cast<size_t>(LZ4_compressBound(static_cast<int>(size)));
+    };
+    auto codec = choose(size);
+    if (m_policy == policy::lz4 && f == format::bgra8888 && levels == 0) {
+        // Left untagged so older versions of the nx library can still read it
+        blob.resize(4 + bound(codec));
+        auto n = compress(codec, pixels, size, blob.data() + 4);
+        put32(blob.data(), static_cast<uint32_t>(n));
+        blob.resize(4 + n);
+        return;
+    }
+    auto start = header(codec) + levels * 8;
+    blob.resize(start + bound(codec));
+    auto n = compress(codec, pixels, size, blob.data() + start);
+    // Compression that barely helps isn't worth the time it takes to decode
+    auto worth = m_policy == policy::automatic ? size - size / 8 : size;
+    if (codec != id::raw && n >= worth) {
+        codec = id::raw;
+        start = header(codec) + levels * 8;
+        blob.resize(start + size);
+        n = compress(codec, pixels, size, blob.data() + start);
+    }
+    put32(blob.data(), tagged | static_cast<uint32_t>(codec) << 24
+                           | static_cast<uint32_t>(f) << 16 | levels);
+    put32(blob.data() + 4, static_cast<uint32_t>(n));
+    if (codec == id::lz4dict) std::memcpy(blob.data() + 8, &dictionary, 8);
+    blob.resize(start + n);
+}
+}
+}
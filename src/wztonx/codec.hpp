@@ -0,0 +1,92 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeWzToNx - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <lz4.h>
+#include <lz4hc.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace nl {
+namespace codec {
+// How a bitmap's pixels are stored, as recorded in its tag. Must match nl::bitmap.
+enum class id : uint8_t { lz4 = 0, raw = 1, zstd = 2, lz4dict = 3 };
+// How the pixels of a bitmap are laid out, as recorded in its tag. Must match nl::bitmap.
+enum class format : uint8_t { bgra8888 = 0, bc1 = 1, bc2 = 2, bc3 = 3 };
+// How many bytes the pixels of a bitmap take up in a format
+size_t length(format f, int32_t width, int32_t height);
+// How many levels get stored after a bitmap, each half the size of the last rounding up, stopping
+// at 1x1 or once there are most of them
+unsigned levels(int32_t width, int32_t height, unsigned most);
+// Levels can't go past what fits in the tag
+unsigned const max_levels = 15;
+// Which codecs wztonx picks from when writing bitmaps
+enum class policy {
+    // Untagged LZ4, readable by every version of the nx library
+    lz4,
+    zstd,
+    // LZ4 primed with a dictionary shared by the whole file
+    lz4dict,
+    raw,
+    // LZ4 with the dictionary for small sprites, zstd for everything else, raw when neither helps
+    automatic
+};
+bool parse(std::string const & name, policy & p);
+char const * name(policy p);
+// Whether the policy needs a dictionary trained for it
+bool uses_dictionary(policy p);
+// Bitmaps up to this many bytes decoded count as small sprites
+size_t const small_bitmap = 0x10000;
+// How much sample data to train the dictionary on
+size_t const sample_budget = 0x400000;
+size_t const max_samples = 0x1000;
+// LZ4 can't see further back than this, so there is no point in a bigger dictionary
+size_t const dictionary_size = 0x10000;
+// Builds a dictionary from concatenated samples, sizes giving the length of each
+std::vector<char> train(std::vector<uint8_t> const & samples, std::vector<size_t> const & sizes);
+// Whether a blob written earlier can be copied elsewhere as is, which isn't true of anything
+// pointing at a dictionary or levels
+bool relocatable(void const * blob);
+// Sets where a level is relative to the start of the blob of the bitmap it belongs to
+void link(std::vector<uint8_t> & blob, unsigned level, int64_t offset);
+// Compresses bitmaps into complete blobs, header included. Not thread safe.
+class encoder {
+public:
+    encoder(policy p, bool hc, int level, std::vector<char> const & dictionary);
+    encoder(encoder const &) = delete;
+    encoder & operator=(encoder const &) = delete;
+    ~encoder();
+    // Dictionary is the offset from where the blob will be written to the dictionary chunk.
+    // Room is left for that many levels, which have to be filled in with link.
+    void encode(format f, uint8_t const * pixels, size_t size, int64_t dictionary, unsigned levels,
+                std::vector<uint8_t> & blob);
+
+private:
+    id choose(size_t size) const;
+    size_t compress(id codec, uint8_t const * pixels, size_t size, uint8_t * out);
+    policy m_policy;
+    bool m_hc;
+    int m_level;
+    std::vector<char> const & m_dictionary;
+    std::vector<uint8_t> m_scratch;
+    LZ4_stream_t * m_stream = nullptr;
+    LZ4_streamHC_t * m_stream_hc = nullptr;
+};
+}
+}
@@ -0,0 +1,182 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeWzToNx - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+
+#include "crypto.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NL_SSE2
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+namespace nl {
+namespace crypto {
+namespace {
+// cp1252 table
+char16_t const cp1252[0x100] = {
+    0x0000, 0x0001, 0x0002, 0x0003, 0x0004, 0x0005, 0x0006, 0x0007, 0x0008, 0x0009, 0x000A, 0x000B,
+    0x000C, 0x000D, 0x000E, 0x000F, 0x0010, 0x0011, 0x0012, 0x0013, 0x0014, 0x0015, 0x0016, 0x0017,
+    0x0018, 0x0019, 0x001A, 0x001B, 0x001C, 0x001D, 0x001E, 0x001F, 0x0020, 0x0021, 0x0022, 0x0023,
+    0x0024, 0x0025, 0x0026, 0x0027, 0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037, 0x0038, 0x0039, 0x003A, 0x003B,
+    0x003C, 0x003D, 0x003E, 0x003F, 0x0040, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+    0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F, 0x0050, 0x0051, 0x0052, 0x0053,
+    0x0054, 0x0055, 0x0056, 0x0057, 0x0058, 0x0059, 0x005A, 0x005B, 0x005C, 0x005D, 0x005E, 0x005F,
+    0x0060, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067, 0x0068, 0x0069, 0x006A, 0x006B,
+    0x006C, 0x006D, 0x006E, 0x006F, 0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+    0x0078, 0x0079, 0x007A, 0x007B, 0x007C, 0x007D, 0x007E, 0x007F, 0x20AC, 0xFFFD, 0x201A, 0x0192,
+    0x201E, 0x2026, 0x2020, 0x2021, 0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0xFFFD, 0x017D, 0xFFFD,
+    0xFFFD, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014, 0x02DC, 0x2122, 0x0161, 0x203A,
+    0x0153, 0xFFFD, 0x017E, 0x0178, 0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7,
+    0x00A8, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF, 0x00B0, 0x00B1, 0x00B2, 0x00B3,
+    0x00B4, 0x00B5, 0x00B6, 0x00B7, 0x00B8, 0x00B9, 0x00BA, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0x00BF,
+    0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7, 0x00C8, 0x00C9, 0x00CA, 0x00CB,
+    0x00CC, 0x00CD, 0x00CE, 0x00CF, 0x00D0, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
+    0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x00DD, 0x00DE, 0x00DF, 0x00E0, 0x00E1, 0x00E2, 0x00E3,
+    0x00E4, 0x00E5, 0x00E6, 0x00E7, 0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+    0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7, 0x00F8, 0x00F9, 0x00FA, 0x00FB,
+    0x00FC, 0x00FD, 0x00FE, 0x00FF};
+// Number of characters the masked tables cover, anything past that only gets the rolling mask
+size_t const masked_length = 0x10000;
+// Enough for the wide table as well as the largest lua script seen so far
+size_t const key_size = 0x20000;
+}
+key::key(std::vector<uint8_t> r) : raw(std::move(r)), ascii(masked_length), wide(masked_length) {
+    auto size = raw.size();
+    for (auto i = size_t{0}; i < masked_length; ++i) {
+        auto k = i < size ? raw[i] : uint8_t{0};
+        ascii[i] = static_cast<uint8_t>(k ^ (0xAA + i));
+    }
+    for (auto i = size_t{0}; i < masked_length; ++i) {
+        auto k = i * 2 + 1 < size ? static_cast<char16_t>(raw[i * 2] | raw[i * 2 + 1] << 8)
+                                  : char16_t{0};
+        wide[i] = static_cast<char16_t>(k ^ (0xAAAA + i));
+    }
+}
+key const & get_key(size_t locale) {
+    static std::mutex lock;
+    static std::vector<std::unique_ptr<key>> cache(locales().size());
+    std::lock_guard<std::mutex> guard{lock};
+    auto & k = cache.at(locale);
+    if (!k) k.reset(new key{generate_key(locales()[locale].iv, key_size)});
+    return *k;
+}
+key const & get_key(std::string const & name) {
+    auto & all = locales();
+    for (auto i = size_t{0}; i < all.size(); ++i)
+        if (name == all[i].name) return get_key(i);
+    throw std::runtime_error{"Unknown locale " + name};
+}
+void xor_bytes(void * out, void const * a, void const * b, size_t n) {
+    auto o = static_cast<uint8_t *>(out);
+    auto pa = static_cast<uint8_t const *>(a);
+    auto pb = static_cast<uint8_t const *>(b);
+    auto i = size_t{0};
+#ifdef NL_SSE2
+    for (; i + 64 <= n; i += 64) {
+        for (auto j = 0; j < 64; j += 16) {
+            auto va = _mm_loadu_si128(reinterpret_cast<__m128i const *>(pa + i + j));
+            auto vb = _mm_loadu_si128(reinterpret_cast<__m128i const *>(pb + i + j));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(o + i + j), _mm_xor_si128(va, vb));
+        }
+    }
+    for (; i + 16 <= n; i += 16) {
+        auto va = _mm_loadu_si128(reinterpret_cast<__m128i const *>(pa + i));
+        auto vb = _mm_loadu_si128(reinterpret_cast<__m128i const *>(pb + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(o + i), _mm_xor_si128(va, vb));
+    }
+#endif
+    for (; i < n; ++i) o[i] = static_cast<uint8_t>(pa[i] ^ pb[i]);
+}
+bool is_ascii(char const * s, size_t n) {
+    auto i = size_t{0};
+#ifdef NL_SSE2
+    auto acc = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16)
+        acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<__m128i const *>(s + i)));
+    if (_mm_movemask_epi8(acc)) return false;
+#endif
+    auto acc8 = 0u;
+    for (; i < n; ++i) acc8 |= static_cast<uint8_t>(s[i]);
+    return acc8 < 0x80;
+}
+bool is_ascii(char16_t const * s, size_t n) {
+    auto i = size_t{0};
+#ifdef NL_SSE2
+    auto acc = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8)
+        acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<__m128i const *>(s + i)));
+    // Any bit above 0x7F in any lane means it isn't ascii
+    auto high = _mm_and_si128(acc, _mm_set1_epi16(static_cast<short>(0xFF80)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xFFFF) return false;
+#endif
+    auto acc16 = 0u;
+    for (; i < n; ++i) acc16 |= s[i];
+    return acc16 < 0x80;
+}
+void decrypt(std::string & out, char const * in, size_t n, key const & k) {
+    out.resize(n);
+    auto m = std::min(n, masked_length);
+    xor_bytes(&out[0], in, k.ascii.data(), m);
+    auto mask = static_cast<uint8_t>(0xAA + m);
+    for (auto i = m; i < n; ++i, ++mask) out[i] = static_cast<char>(in[i] ^ mask);
+}
+void decrypt(std::u16string & out, char16_t const * in, size_t n, key const & k) {
+    out.resize(n);
+    auto m = std::min(n, masked_length);
+    xor_bytes(&out[0], in, k.wide.data(), m * 2);
+    auto mask = static_cast<char16_t>(0xAAAA + m);
+    for (auto i = m; i < n; ++i, ++mask) out[i] = static_cast<char16_t>(in[i] ^ mask);
+}
+void cp1252_to_utf8(std::string & out, char const * in, size_t n) {
+    out.clear();
+    out.reserve(n * 3);
+    for (auto i = size_t{0}; i < n; ++i) {
+        auto c = static_cast<uint8_t>(in[i]);
+        if (c < 0x80) {
+            out.push_back(static_cast<char>(c));
+            continue;
+        }
+        auto w = static_cast<unsigned>(cp1252[c]);
+        if (w < 0x800) {
+            out.push_back(static_cast<char>(0xC0 | w >> 6));
+        } else {
+            out.push_back(static_cast<char>(0xE0 | w >> 12));
+            out.push_back(static_cast<char>(0x80 | (w >> 6 & 0x3F)));
+        }
+        out.push_back(static_cast<char>(0x80 | (w & 0x3F)));
+    }
+}
+void narrow(std::string & out, char16_t const * in, size_t n) {
+    out.resize(n);
+    auto i = size_t{0};
+#ifdef NL_SSE2
+    for (; i + 16 <= n; i += 16) {
+        auto a = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i));
+        auto b = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i + 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(&out[i]), _mm_packus_epi16(a, b));
+    }
+#endif
+    for (; i < n; ++i) out[i] = static_cast<char>(in[i]);
+}
+}
+}
@@ -0,0 +1,64 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeWzToNx - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace nl {
+namespace crypto {
+// A WZ key along with copies that have the rolling masks of encrypted strings already applied,
+// so decrypting a string is a single xor against the right table
+struct key {
+    key(std::vector<uint8_t> raw);
+    // The plain key, used as is by canvases and lua scripts
+    std::vector<uint8_t> raw;
+    // raw[i] ^ (0xAA + i)
+    std::vector<uint8_t> ascii;
+    // raw as char16_t[i] ^ (0xAAAA + i)
+    std::vector<char16_t> wide;
+};
+// A region along with the IV its key is generated from
+struct locale {
+    char const * name;
+    std::array<uint8_t, 4> iv;
+};
+// All known locales, later ones being preferred when more than one key fits
+std::vector<locale> const & locales();
+// Generates size bytes of the key for an IV with AES, an all zero IV giving an all zero key
+std::vector<uint8_t> generate_key(std::array<uint8_t, 4> const & iv, size_t size);
+// The key of a locale, generated the first time it is asked for and shared after that
+key const & get_key(size_t locale);
+key const & get_key(std::string const & name);
+// Stores a ^ b into out, any of which may alias
+void xor_bytes(void * out, void const * a, void const * b, size_t n);
+// Whether none of the characters are above 0x7F
+bool is_ascii(char const * s, size_t n);
+bool is_ascii(char16_t const * s, size_t n);
+// Decrypts an 8 bit string, which is left in cp1252
+void decrypt(std::string & out, char const * in, size_t n, key const & k);
+// Decrypts a UTF-16 string
+void decrypt(std::u16string & out, char16_t const * in, size_t n, key const & k);
+// Converts a cp1252 string to UTF-8
+void cp1252_to_utf8(std::string & out, char const * in, size_t n);
+// Narrows a UTF-16 string which is_ascii said is ascii
+void narrow(std::string & out, char16_t const * in, size_t n);
+}
+}
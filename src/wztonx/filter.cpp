@@ -0,0 +1,124 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeWzToNx - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+#include "filter.hpp"
+#include "cache.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace nl {
+namespace {
+// In the order of the NX node types
+char const * const types[] = {"none", "integer", "real", "string", "vector", "bitmap", "audio",
+                              "uol"};
+// Matches a name against a pattern where * is any run of characters and ? is any one
+bool match(std::string const & pattern, std::string const & name) {
+    auto p = size_t{0}, n = size_t{0};
+    auto star = std::string::npos, resume = size_t{0};
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            ++p;
+            ++n;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            resume = n;
+        } else if (star != std::string::npos) {
+            p = star + 1;
+            n = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') ++p;
+    return p == pattern.size();
+}
+bool match(std::vector<std::string> const & pattern, size_t p,
+           std::vector<std::string> const & path, size_t n) {
+    for (; p < pattern.size(); ++p, ++n) {
+        if (pattern[p] == "**") {
+            for (auto i = n; i <= path.size(); ++i)
+                if (match(pattern, p + 1, path, i)) return true;
+            return false;
+        }
+        if (n == path.size() || !match(pattern[p], path[n])) return false;
+    }
+    return n == path.size();
+}
+}
+// Canvases are kept so servers can still see they exist, just without anything under them that
+// only matters for drawing them
+char const filter::server[] = R"(- origin
+- ** audio
+# Map backgrounds, objects and tiles
+- /Back
+- /Obj
+- /Tile
+)";
+void filter::parse(std::string const & text) {
+    std::istringstream lines{text};
+    std::string line;
+    while (std::getline(lines, line)) {
+        std::istringstream words{line};
+        std::string op, pattern, type;
+        if (!(words >> op) || op[0] == '#') continue;
+        if ((op != "-" && op != "+") || !(words >> pattern))
+            throw std::runtime_error("Invalid filter rule: " + line);
+        rule r{op == "+", pattern.find('/') == std::string::npos, {}, -1};
+        if (words >> type) {
+            for (auto i = 0; i < 8; ++i)
+                if (type == types[i]) r.type = i;
+            if (r.type < 0) throw std::runtime_error("Unknown node type in filter rule: " + line);
+        }
+        // A leading / makes a single name a path from the root
+        auto b = pattern[0] == '/' ? size_t{1} : size_t{0};
+        if (b) r.anywhere = false;
+        for (auto i = b; i <= pattern.size(); ++i) {
+            if (i != pattern.size() && pattern[i] != '/') continue;
+            if (i > b) r.pattern.push_back(pattern.substr(b, i - b));
+            b = i + 1;
+        }
+        if (r.pattern.empty()) throw std::runtime_error("Invalid filter rule: " + line);
+        // ** on its own matches everything, not just things named **
+        if (r.pattern.size() == 1 && r.pattern[0] == "**") r.anywhere = false;
+        m_rules.push_back(std::move(r));
+        m_text += line;
+        m_text += '\n';
+    }
+}
+void filter::load(std::string const & path) {
+    std::ifstream file{path};
+    if (!file.is_open()) throw std::runtime_error("Failed to open filter " + path);
+    std::ostringstream text;
+    text << file.rdbuf();
+    parse(text.str());
+}
+bool filter::keep(std::vector<std::string> const & path, uint16_t type) const {
+    for (auto it = m_rules.rbegin(); it != m_rules.rend(); ++it) {
+        auto & r = *it;
+        if (r.type >= 0 && r.type != type) continue;
+        if (r.anywhere ? !path.empty() && match(r.pattern[0], path.back())
+                       : match(r.pattern, 0, path, 0))
+            return r.keep;
+    }
+    return true;
+}
+uint64_t filter::hash() const {
+    return m_text.empty() ? 0 : cache::hash(m_text.data(), m_text.size());
+}
+}
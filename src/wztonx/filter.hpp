@@ -0,0 +1,58 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeWzToNx - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace nl {
+// Which nodes wztonx leaves out, as a list of rules, one per line:
+//   - /Back/*              drop a path, which always starts from the root of the file
+//   + /Back/grassySoil.img keep something an earlier rule dropped
+//   - Map/Map*/*.img/back  * and ? match within a name, ** matches any number of names
+//   - origin               a single name without a / is dropped wherever it is
+//   - ** audio             only drop nodes of a type
+// Blank lines and lines starting with # are ignored. The last rule to match a node decides what
+// happens to it and anything no rule matches is kept. Dropping a node drops everything under it.
+class filter {
+public:
+    // Adds the rules in some text, throwing if any of them don't make sense
+    void parse(std::string const & text);
+    // Adds the rules in a file
+    void load(std::string const & path);
+    bool empty() const { return m_rules.empty(); }
+    // Whether to keep a node, given the names from the root down to it and its NX node type
+    bool keep(std::vector<std::string> const & path, uint16_t type) const;
+    // Changes whenever the rules do, so the .nxcache can tell
+    uint64_t hash() const;
+    // What --server drops: everything that is only ever drawn or played
+    static char const server[];
+
+private:
+    struct rule {
+        bool keep;
+        // Whether it is just a name, matched at any depth
+        bool anywhere;
+        std::vector<std::string> pattern;
+        // The node type it is limited to, or -1 for any
+        int type;
+    };
+    std::vector<rule> m_rules;
+    std::string m_text;
+};
+}
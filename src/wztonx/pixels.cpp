@@ -0,0 +1,313 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeWzToNx - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+
+#include "pixels.hpp"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define NL_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC lets any function use any intrinsic
+#define NL_TARGET_AVX2
+#else
+#define NL_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NL_SSE2
+#endif
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+namespace nl {
+namespace pixels {
+namespace {
+// Tables for color lookups
+uint8_t const table4[0x10] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+uint8_t const table5[0x20] = {0x00, 0x08, 0x10, 0x19, 0x21, 0x29, 0x31, 0x3A, 0x42, 0x4A, 0x52,
+0x5A, 0x63, 0x6B, 0x73, 0x7B, 0x84, 0x8C, 0x94, 0x9C, 0xA5, 0xAD,
+0xB5, 0xBD, 0xC5, 0xCE, 0xD6, 0xDE, 0xE6, 0xEF, 0xF7, 0xFF};
+uint8_t const table6[0x40] = {
+    0x00, 0x04, 0x08, 0x0C, 0x10, 0x14, 0x18, 0x1C, 0x20, 0x24, 0x28, 0x2D, 0x31, 0x35, 0x39, 0x3D,
+    0x41, 0x45, 0x49, 0x4D, 0x51, 0x55, 0x59, 0x5D, 0x61, 0x65, 0x69, 0x6D, 0x71, 0x75, 0x79, 0x7D,
+    0x82, 0x86, 0x8A, 0x8E, 0x92, 0x96, 0x9A, 0x9E, 0xA2, 0xA6, 0xAA, 0xAE, 0xB2, 0xB6, 0xBA, 0xBE,
+    0xC2, 0xC6, 0xCA, 0xCE, 0xD2, 0xD7, 0xDB, 0xDF, 0xE3, 0xE7, 0xEB, 0xEF, 0xF3, 0xF7, 0xFB, 0xFF};
+struct color4444 {
+    uint8_t b : 4;
+    uint8_t g : 4;
+    uint8_t r : 4;
+    uint8_t a : 4;
+};
+static_assert(sizeof(color4444) == 2, "Your bitpacking sucks");
+struct color8888 {
+    uint8_t b;
+    uint8_t g;
+    uint8_t r;
+    uint8_t a;
+};
+static_assert(sizeof(color8888) == 4, "Your bitpacking sucks");
+struct color565 {
+    uint16_t b : 5;
+    uint16_t g : 6;
+    uint16_t r : 5;
+};
+static_assert(sizeof(color565) == 2, "Your bitpacking sucks");
+// Scalar versions, also used for whatever is left over by the vector versions
+void expand4444_scalar(uint8_t const * in, uint8_t * out, size_t count) {
+    auto pin = reinterpret_cast<color4444 const *>(in);
+    auto pout = reinterpret_cast<color8888 *>(out);
+    for (auto i = size_t{0}; i < count; ++i) {
+        auto p = pin[i];
+        pout[i] = {table4[p.b], table4[p.g], table4[p.r], table4[p.a]};
+    }
+}
+void expand565_scalar(uint8_t const * in, uint8_t * out, size_t count) {
+    auto pin = reinterpret_cast<color565 const *>(in);
+    auto pout = reinterpret_cast<color8888 *>(out);
+    for (auto i = size_t{0}; i < count; ++i) {
+        auto p = pin[i];
+        pout[i] = {table5[p.b], table6[p.g], table5[p.r], 255};
+    }
+}
+void fill_scalar(uint32_t * out, uint32_t p, int n) { std::fill_n(out, n, p); }
+#ifdef NL_SSE2
+// Each nibble n becomes n * 0x11, same as table4
+void expand4444_sse2(uint8_t const * in, uint8_t * out, size_t count) {
+    auto const mask = _mm_set1_epi8(0x0F);
+    auto i = size_t{0};
+    for (; i + 8 <= count; i += 8) {
+        auto v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i * 2));
+        auto lo = _mm_and_si128(v, mask);
+        auto hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+        auto p0 = _mm_unpacklo_epi8(lo, hi);
+        auto p1 = _mm_unpackhi_epi8(lo, hi);
+        p0 = _mm_or_si128(p0, _mm_slli_epi16(p0, 4));
+        p1 = _mm_or_si128(p1, _mm_slli_epi16(p1, 4));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * 4), p0);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * 4 + 16), p1);
+    }
+    expand4444_scalar(in + i * 2, out + i * 4, count - i);
+}
+// (x * 527 + 23) >> 6 and (x * 259 + 33) >> 6 round exactly like table5 and table6
+void expand565_sse2(uint8_t const * in, uint8_t * out, size_t count) {
+    auto const m5 = _mm_set1_epi16(0x1F);
+    auto const m6 = _mm_set1_epi16(0x3F);
+    auto const k5 = _mm_set1_epi16(527);
+    auto const a5 = _mm_set1_epi16(23);
+    auto const k6 = _mm_set1_epi16(259);
+    auto const a6 = _mm_set1_epi16(33);
+    auto const alpha = _mm_set1_epi16(static_cast<short>(0xFF00));
+    auto i = size_t{0};
+    for (; i + 8 <= count; i += 8) {
+        auto v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i * 2));
+        auto b = _mm_and_si128(v, m5);
+        auto g = _mm_and_si128(_mm_srli_epi16(v, 5), m6);
+        auto r = _mm_srli_epi16(v, 11);
+        b = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(b, k5), a5), 6);
+        g = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(g, k6), a6), 6);
+        r = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(r, k5), a5), 6);
+        auto bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+        auto ra = _mm_or_si128(r, alpha);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * 4), _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * 4 + 16),
+            _mm_unpackhi_epi16(bg, ra));
+    }
+    expand565_scalar(in + i * 2, out + i * 4, count - i);
+}
+void fill_sse2(uint32_t * out, uint32_t p, int n) {
+    auto v = _mm_set1_epi32(static_cast<int>(p));
+    auto i = 0;
+    for (; i + 4 <= n; i += 4) _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), v);
+    fill_scalar(out + i, p, n - i);
+}
+#endif
+#ifdef NL_X86
+// The 256 bit unpacks work within each 128 bit lane, so the halves get stitched back together
+NL_TARGET_AVX2 void expand4444_avx2(uint8_t const * in, uint8_t * out, size_t count) {
+    auto const mask = _mm256_set1_epi8(0x0F);
+    auto i = size_t{0};
+    for (; i + 16 <= count; i += 16) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(in + i * 2));
+        auto lo = _mm256_and_si256(v, mask);
+        auto hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+        auto p0 = _mm256_unpacklo_epi8(lo, hi);
+        auto p1 = _mm256_unpackhi_epi8(lo, hi);
+        p0 = _mm256_or_si256(p0, _mm256_slli_epi16(p0, 4));
+        p1 = _mm256_or_si256(p1, _mm256_slli_epi16(p1, 4));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i * 4),
+            _mm256_permute2x128_si256(p0, p1, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i * 4 + 32),
+            _mm256_permute2x128_si256(p0, p1, 0x31));
+    }
+    expand4444_scalar(in + i * 2, out + i * 4, count - i);
+}
+NL_TARGET_AVX2 void expand565_avx2(uint8_t const * in, uint8_t * out, size_t count) {
+    auto const m5 = _mm256_set1_epi16(0x1F);
+    auto const m6 = _mm256_set1_epi16(0x3F);
+    auto const k5 = _mm256_set1_epi16(527);
+    auto const a5 = _mm256_set1_epi16(23);
+    auto const k6 = _mm256_set1_epi16(259);
+    auto const a6 = _mm256_set1_epi16(33);
+    auto const alpha = _mm256_set1_epi16(static_cast<short>(0xFF00));
+    auto i = size_t{0};
+    for (; i + 16 <= count; i += 16) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(in + i * 2));
+        auto b = _mm256_and_si256(v, m5);
+        auto g = _mm256_and_si256(_mm256_srli_epi16(v, 5), m6);
+        auto r = _mm256_srli_epi16(v, 11);
+        b = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(b, k5), a5), 6);
+        g = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(g, k6), a6), 6);
+        r = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(r, k5), a5), 6);
+        auto bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+        auto ra = _mm256_or_si256(r, alpha);
+        auto p0 = _mm256_unpacklo_epi16(bg, ra);
+        auto p1 = _mm256_unpackhi_epi16(bg, ra);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i * 4),
+            _mm256_permute2x128_si256(p0, p1, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i * 4 + 32),
+            _mm256_permute2x128_si256(p0, p1, 0x31));
+    }
+    expand565_scalar(in + i * 2, out + i * 4, count - i);
+}
+NL_TARGET_AVX2 void fill_avx2(uint32_t * out, uint32_t p, int n) {
+    auto v = _mm256_set1_epi32(static_cast<int>(p));
+    auto i = 0;
+    for (; i + 8 <= n; i += 8) _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), v);
+    fill_scalar(out + i, p, n - i);
+}
+bool has_avx2() {
+#ifdef _MSC_VER
+    int r[4];
+    __cpuid(r, 0);
+    if (r[0] < 7) return false;
+    __cpuid(r, 1);
+    // Need both AVX and the OS saving the ymm registers for us
+    if ((r[2] & (1 << 27)) == 0 || (r[2] & (1 << 28)) == 0) return false;
+    if ((_xgetbv(0) & 6) != 6) return false;
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+#endif
+// The kernels everything dispatches to, picked once at startup
+struct dispatch {
+    void (*expand4444)(uint8_t const *, uint8_t *, size_t) = expand4444_scalar;
+    void (*expand565)(uint8_t const *, uint8_t *, size_t) = expand565_scalar;
+    void (*fill)(uint32_t *, uint32_t, int) = fill_scalar;
+    char const * name = "scalar";
+    dispatch() {
+#ifdef NL_SSE2
+        expand4444 = expand4444_sse2;
+        expand565 = expand565_sse2;
+        fill = fill_sse2;
+        name = "SSE2";
+#endif
+#ifdef NL_X86
+        if (has_avx2()) {
+            expand4444 = expand4444_avx2;
+            expand565 = expand565_avx2;
+            fill = fill_avx2;
+            name = "AVX2";
+        }
+#endif
+    }
+};
+dispatch const kernels;
+}
+void expand4444(uint8_t const * in, uint8_t * out, size_t count) {
+    kernels.expand4444(in, out, count);
+}
+void expand565(uint8_t const * in, uint8_t * out, size_t count) {
+    kernels.expand565(in, out, count);
+}
+void scale(uint8_t const * in, uint8_t * out, int width, int height, int n) {
+    auto pin = reinterpret_cast<uint32_t const *>(in);
+    auto pout = reinterpret_cast<uint32_t *>(out);
+    auto w = width / n;
+    auto h = height / n;
+    auto row = static_cast<size_t>(width);
+    for (auto y = 0; y < h; ++y) {
+        // Build the first row of the block strip, then copy it down the rest of the strip
+        auto first = pout + static_cast<size_t>(y) * n * row;
+        for (auto x = 0; x < w; ++x) kernels.fill(first + x * n, pin[y * w + x], n);
+        for (auto yy = 1; yy < n; ++yy)
+            std::memcpy(first + yy * row, first, static_cast<size_t>(w) * n * 4);
+    }
+}
+void halve(uint8_t const * in, uint8_t * out, int width, int height) {
+    auto pin = reinterpret_cast<color8888 const *>(in);
+    auto pout = reinterpret_cast<color8888 *>(out);
+    auto w = (width + 1) / 2;
+    auto h = (height + 1) / 2;
+    for (auto y = 0; y < h; ++y) {
+        for (auto x = 0; x < w; ++x) {
+            unsigned b = 0, g = 0, r = 0, a = 0, n = 0;
+            for (auto yy = y * 2; yy < std::min(y * 2 + 2, height); ++yy) {
+                for (auto xx = x * 2; xx < std::min(x * 2 + 2, width); ++xx) {
+                    auto p = pin[static_cast<size_t>(yy) * width + xx];
+                    b += p.b * p.a;
+                    g += p.g * p.a;
+                    r += p.r * p.a;
+                    a += p.a;
+                    ++n;
+                }
+            }
+            auto & p = pout[static_cast<size_t>(y) * w + x];
+            if (a == 0) {
+                p = {0, 0, 0, 0};
+                continue;
+            }
+            p = {static_cast<uint8_t>((b + a / 2) / a), static_cast<uint8_t>((g + a / 2) / a),
+                 static_cast<uint8_t>((r + a / 2) / a), static_cast<uint8_t>((a + n / 2) / n)};
+        }
+    }
+}
+void swap_rb(uint8_t const * in, uint8_t * out, size_t count) {
+    auto pin = reinterpret_cast<color8888 const *>(in);
+    auto pout = reinterpret_cast<color8888 *>(out);
+    for (auto i = size_t{0}; i < count; ++i) {
+        auto p = pin[i];
+        pout[i] = {p.r, p.g, p.b, p.a};
+    }
+}
+void swap_block_rb(uint8_t * blocks, size_t count) {
+    for (auto i = size_t{0}; i < count; ++i) {
+        // The colour half of the block starts with two little endian RGB565 endpoints
+        for (auto e = blocks + i * 16 + 8; e != blocks + i * 16 + 12; e += 2) {
+            auto p = static_cast<uint16_t>(e[0] | e[1] << 8);
+            p = static_cast<uint16_t>((p & 0x07e0) | p >> 11 | (p & 0x1f) << 11);
+            e[0] = static_cast<uint8_t>(p);
+            e[1] = static_cast<uint8_t>(p >> 8);
+        }
+    }
+}
+bool binary_alpha(uint8_t const * in, size_t count) {
+    auto pin = reinterpret_cast<color8888 const *>(in);
+    for (auto i = size_t{0}; i < count; ++i)
+        if (pin[i].a != 0 && pin[i].a != 255) return false;
+    return true;
+}
+char const * isa() { return kernels.name; }
+}
+}
@@ -0,0 +1,42 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeWzToNx - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace nl {
+namespace pixels {
+// Expands ARGB4444 pixels to BGRA8888
+void expand4444(uint8_t const * in, uint8_t * out, size_t count);
+// Expands RGB565 pixels to BGRA8888 with an opaque alpha
+void expand565(uint8_t const * in, uint8_t * out, size_t count);
+// Takes a (width / n) by (height / n) BGRA8888 image and blows every pixel up into an n by n block
+void scale(uint8_t const * in, uint8_t * out, int width, int height, int n);
+// Shrinks BGRA8888 pixels to half the width and height rounding up, averaging each 2x2 block
+// weighted by alpha so transparent pixels don't darken the edges
+void halve(uint8_t const * in, uint8_t * out, int width, int height);
+// Swaps the red and blue of BGRA8888 pixels, giving RGBA8888
+void swap_rb(uint8_t const * in, uint8_t * out, size_t count);
+// Swaps the red and blue of both colour endpoints in each of count BC2 or BC3 blocks, in place
+void swap_block_rb(uint8_t * blocks, size_t count);
+// Whether every pixel is either fully opaque or fully transparent
+bool binary_alpha(uint8_t const * in, size_t count);
+// Name of the instruction set the kernels were dispatched to at startup
+char const * isa();
+}
+}
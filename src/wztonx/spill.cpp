@@ -0,0 +1,223 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeWzToNx - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+#include "spill.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define VC_EXTRALEAN
+#define NOMINMAX
+#include <Windows.h>
+#include <Psapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <condition_variable>
+#include <cstdlib>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace nl {
+namespace {
+// Temporary files grow by at least this much at a time
+size_t const chunk_size = 64 << 20;
+// How often the resident size is checked, which is also about how long it can be over the limit
+auto const interval = std::chrono::milliseconds{1};
+struct region {
+    void const * data;
+    size_t size;
+};
+// Held while dropping, so nothing can be unmapped and its addresses reused in the meantime
+std::mutex regions_mutex;
+std::vector<region> regions;
+void drop(region const & r) {
+#ifdef _WIN32
+    // Unlocking pages that aren't locked takes them out of the working set
+    VirtualUnlock(const_cast<void *>(r.data), r.size);
+#else
+    madvise(const_cast<void *>(r.data), r.size, MADV_DONTNEED);
+#endif
+}
+class limiter {
+public:
+    ~limiter() { set(0); }
+    void set(uint64_t limit) {
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_limit = limit;
+        }
+        m_wake.notify_all();
+        if (limit == 0 && m_thread.joinable()) m_thread.join();
+        if (limit != 0 && !m_thread.joinable()) m_thread = std::thread{[this] { watch(); }};
+    }
+
+private:
+    void watch() {
+        std::unique_lock<std::mutex> lock{m_mutex};
+        while (m_limit != 0) {
+            m_wake.wait_for(lock, interval);
+            if (m_limit == 0 || resident() <= m_limit) continue;
+            std::lock_guard<std::mutex> guard{regions_mutex};
+            for (auto & r : regions) drop(r);
+        }
+    }
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    uint64_t m_limit = 0;
+} resident_limit;
+}
+void track(void const * data, size_t size) {
+    std::lock_guard<std::mutex> lock{regions_mutex};
+    regions.push_back({data, size});
+}
+void untrack(void const * data) {
+    std::lock_guard<std::mutex> lock{regions_mutex};
+    regions.erase(std::remove_if(regions.begin(), regions.end(),
+        [data](region const & r) { return r.data == data; }), regions.end());
+}
+void limit_resident(uint64_t limit) { resident_limit.set(limit); }
+uint64_t resident() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return counters.WorkingSetSize;
+#elif defined(__APPLE__)
+    mach_task_basic_info info{};
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info),
+        &count) != KERN_SUCCESS)
+        return 0;
+    return info.resident_size;
+#elif defined(__linux__)
+    // The second number is the resident size in pages
+    static int const file = open("/proc/self/statm", O_RDONLY);
+    char buf[128];
+    auto n = file == -1 ? -1 : pread(file, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+    unsigned long long size, pages;
+    if (std::sscanf(buf, "%llu %llu", &size, &pages) != 2) return 0;
+    return pages * static_cast<uint64_t>(sysconf(_SC_PAGE_SIZE));
+#else
+    return 0;
+#endif
+}
+spill_buffer::~spill_buffer() {
+    if (!m_spilled) {
+        std::free(m_data);
+        return;
+    }
+    if (m_data) untrack(m_data);
+#ifdef _WIN32
+    if (m_data) UnmapViewOfFile(m_data);
+    if (m_map) CloseHandle(m_map);
+    CloseHandle(m_file);
+#else
+    if (m_data) munmap(m_data, m_capacity);
+    close(m_file);
+#endif
+}
+void spill_buffer::swap(spill_buffer & other) {
+    std::swap(m_data, other.m_data);
+    std::swap(m_capacity, other.m_capacity);
+    std::swap(m_spilled, other.m_spilled);
+    std::swap(m_file, other.m_file);
+#ifdef _WIN32
+    std::swap(m_map, other.m_map);
+#endif
+}
+void spill_buffer::spill(std::string const & dir) {
+    if (m_spilled) return;
+#ifdef _WIN32
+    char name[MAX_PATH];
+    if (!GetTempFileNameA(dir.c_str(), "nx", 0, name))
+        throw std::runtime_error("Failed to create a temporary file in " + dir);
+    m_file = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Failed to open temporary file " + std::string{name});
+#else
+    auto pattern = dir + "/nxspillXXXXXX";
+    std::vector<char> name{pattern.begin(), pattern.end()};
+    name.push_back('\0');
+    m_file = mkstemp(name.data());
+    if (m_file == -1) throw std::runtime_error("Failed to create a temporary file in " + dir);
+    // Nobody else needs to see it, and this way it goes away no matter how we exit
+    unlink(name.data());
+#endif
+    auto old = m_data;
+    auto size = m_capacity;
+    m_data = nullptr;
+    m_capacity = 0;
+    m_spilled = true;
+    if (size) {
+        remap(size);
+        std::memcpy(m_data, old, size);
+    }
+    std::free(old);
+}
+void spill_buffer::reserve(size_t n) {
+    if (n <= m_capacity) return;
+    if (!m_spilled) {
+        auto p = static_cast<char *>(std::realloc(m_data, n));
+        if (!p) throw std::bad_alloc{};
+        m_data = p;
+        m_capacity = n;
+        return;
+    }
+    remap(std::max(n, m_capacity + chunk_size));
+}
+void spill_buffer::remap(size_t n) {
+    // Growing the file keeps what was written, so only the view has to be recreated
+    if (m_data) untrack(m_data);
+#ifdef _WIN32
+    if (m_data) UnmapViewOfFile(m_data);
+    if (m_map) CloseHandle(m_map);
+    m_data = nullptr;
+    m_map = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE, static_cast<DWORD>(n >> 32),
+        static_cast<DWORD>(n & 0xffffffff), nullptr);
+    if (!m_map) throw std::runtime_error("Failed to grow temporary file");
+    m_data = static_cast<char *>(MapViewOfFile(m_map, FILE_MAP_ALL_ACCESS, 0, 0, n));
+    if (!m_data) throw std::runtime_error("Failed to map temporary file");
+#else
+    if (m_data) munmap(m_data, m_capacity);
+    m_data = nullptr;
+    if (ftruncate(m_file, static_cast<off_t>(n)) == -1)
+        throw std::runtime_error("Failed to grow temporary file");
+    auto p = mmap(nullptr, n, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, 0);
+    if (p == MAP_FAILED) throw std::runtime_error("Failed to map temporary file");
+    // Otherwise touching a byte can map in a whole huge page, and jumping around a table fills
+    // up memory faster than anything can be dropped
+    madvise(p, n, MADV_RANDOM);
+    m_data = static_cast<char *>(p);
+#endif
+    m_capacity = n;
+    track(m_data, m_capacity);
+}
+}
@@ -0,0 +1,119 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeWzToNx - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <cstdint>
+#include <new>
+#include <string>
+#include <utility>
+
+namespace nl {
+// Memory mapped from a file can be dropped from the process at any time without losing anything,
+// since it is read back in from the file when touched again. Spilled buffers are tracked on their
+// own, other mappings such as the input have to be added.
+void track(void const * data, size_t size);
+void untrack(void const * data);
+// Keeps the process within limit bytes of physical memory by dropping whatever is tracked each time
+// it goes over, checked on a thread of its own. 0 turns it off.
+void limit_resident(uint64_t limit);
+// How much physical memory the process is using, or 0 if that can't be found out
+uint64_t resident();
+// Raw storage that is either heap memory or a temporary file mapped into memory, so the big tables
+// of a conversion can be paged out to disk instead of having to fit in RAM
+class spill_buffer {
+public:
+    spill_buffer() = default;
+    spill_buffer(spill_buffer const &) = delete;
+    spill_buffer & operator=(spill_buffer const &) = delete;
+    ~spill_buffer();
+    // Moves the contents into a temporary file in the given directory
+    void spill(std::string const & dir);
+    // Grows to at least n bytes, keeping the contents
+    void reserve(size_t n);
+    void swap(spill_buffer & other);
+    char * data() const { return m_data; }
+    size_t capacity() const { return m_capacity; }
+    bool spilled() const { return m_spilled; }
+
+private:
+    void remap(size_t n);
+    char * m_data = nullptr;
+    size_t m_capacity = 0;
+    bool m_spilled = false;
+#ifdef _WIN32
+    void * m_file = nullptr;
+    void * m_map = nullptr;
+#else
+    int m_file = -1;
+#endif
+};
+// Just enough of std::vector for the tables in wztonx, and only for trivially copyable types
+template <typename T>
+class spill_vector {
+public:
+    spill_vector() = default;
+    // Starts out spilled to the given directory, or in memory if it is empty
+    explicit spill_vector(std::string const & dir) {
+        if (!dir.empty()) spill(dir);
+    }
+    void spill(std::string const & dir) { m_buf.spill(dir); }
+    void swap(spill_vector & other) {
+        m_buf.swap(other.m_buf);
+        std::swap(m_size, other.m_size);
+    }
+    T * data() const { return reinterpret_cast<T *>(m_buf.data()); }
+    T * begin() const { return data(); }
+    T * end() const { return data() + m_size; }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    T & operator[](size_t n) const { return data()[n]; }
+    T & back() const { return data()[m_size - 1]; }
+    void reserve(size_t n) { m_buf.reserve(n * sizeof(T)); }
+    void clear() { m_size = 0; }
+    void assign(size_t n, T const & v) {
+        grow(n);
+        std::fill(data(), data() + n, v);
+        m_size = n;
+    }
+    void resize(size_t n) {
+        grow(n);
+        for (auto i = m_size; i < n; ++i) new (data() + i) T{};
+        m_size = n;
+    }
+    void push_back(T const & v) {
+        grow(m_size + 1);
+        std::memcpy(static_cast<void *>(data() + m_size), &v, sizeof(T));
+        ++m_size;
+    }
+    void append(T const * v, size_t n) {
+        grow(m_size + n);
+        std::memcpy(static_cast<void *>(data() + m_size), v, n * sizeof(T));
+        m_size += n;
+    }
+
+private:
+    void grow(size_t n) {
+        if (n * sizeof(T) <= m_buf.capacity()) return;
+        m_buf.reserve(std::max(n * sizeof(T), m_buf.capacity() * 2));
+    }
+    spill_buffer m_buf;
+    size_t m_size = 0;
+};
+}
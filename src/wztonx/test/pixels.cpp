@@ -0,0 +1,135 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeWzToNx - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+
+// Checks every pixel kernel the CPU can run against the tables and scale<N> they replaced. The
+// kernels live in an anonymous namespace, so the source is pulled in whole
+#include "../pixels.cpp"
+#include <cstdio>
+#include <vector>
+
+namespace nl {
+namespace pixels {
+namespace {
+int failures = 0;
+void check(bool ok, char const * what, char const * isa, size_t at) {
+    if (ok) return;
+    if (++failures <= 20) std::printf("%s (%s) differs at %zu\n", what, isa, at);
+}
+template <int N>
+void old_scale(std::vector<uint8_t> const & input, std::vector<uint8_t> & output, int width,
+               int height) {
+    auto in = reinterpret_cast<uint32_t const *>(input.data());
+    auto out = reinterpret_cast<uint32_t *>(output.data());
+    auto w = width / N;
+    auto h = height / N;
+    for (auto y = 0; y < h; ++y) {
+        for (auto x = 0; x < w; ++x) {
+            auto p = in[y * w + x];
+            for (auto yy = y * N; yy < (y + 1) * N; ++yy) {
+                for (auto xx = x * N; xx < (x + 1) * N; ++xx) { out[yy * width + xx] = p; }
+            }
+        }
+    }
+}
+struct kernel_set {
+    char const * name;
+    void (*expand4444)(uint8_t const *, uint8_t *, size_t);
+    void (*expand565)(uint8_t const *, uint8_t *, size_t);
+    void (*fill)(uint32_t *, uint32_t, int);
+};
+std::vector<kernel_set> available() {
+    std::vector<kernel_set> sets{{"scalar", expand4444_scalar, expand565_scalar, fill_scalar}};
+#ifdef NL_SSE2
+    sets.push_back({"SSE2", expand4444_sse2, expand565_sse2, fill_sse2});
+#endif
+#ifdef NL_X86
+    if (has_avx2()) sets.push_back({"AVX2", expand4444_avx2, expand565_avx2, fill_avx2});
+#endif
+    return sets;
+}
+void test_expand(kernel_set const & k) {
+    // Every possible 16 bit pixel, little endian like the WZ files
+    std::vector<uint8_t> in(0x20000);
+    for (auto i = 0u; i < 0x10000; ++i) {
+        in[i * 2] = static_cast<uint8_t>(i);
+        in[i * 2 + 1] = static_cast<uint8_t>(i >> 8);
+    }
+    std::vector<uint8_t> out4444(0x40000), out565(0x40000);
+    k.expand4444(in.data(), out4444.data(), 0x10000);
+    k.expand565(in.data(), out565.data(), 0x10000);
+    for (auto i = 0u; i < 0x10000; ++i) {
+        uint8_t const want4444[4] = {table4[i & 0xF], table4[i >> 4 & 0xF], table4[i >> 8 & 0xF],
+                                     table4[i >> 12]};
+        uint8_t const want565[4] = {table5[i & 0x1F], table6[i >> 5 & 0x3F], table5[i >> 11],
+                                    255};
+        check(!std::memcmp(out4444.data() + i * 4, want4444, 4), "expand4444", k.name, i);
+        check(!std::memcmp(out565.data() + i * 4, want565, 4), "expand565", k.name, i);
+    }
+    // Odd lengths and offsets, so the scalar tails of the vector kernels get used too
+    for (auto start = 0u; start < 3; ++start) {
+        for (auto count = 0u; count < 40; ++count) {
+            std::vector<uint8_t> got(count * 4 + 4, 0xCD);
+            k.expand4444(in.data() + start * 2, got.data(), count);
+            check(!std::memcmp(got.data(), out4444.data() + start * 4, count * 4),
+                  "expand4444 tail", k.name, count);
+            check(got[count * 4] == 0xCD, "expand4444 overrun", k.name, count);
+            got.assign(count * 4 + 4, 0xCD);
+            k.expand565(in.data() + start * 2, got.data(), count);
+            check(!std::memcmp(got.data(), out565.data() + start * 4, count * 4),
+                  "expand565 tail", k.name, count);
+            check(got[count * 4] == 0xCD, "expand565 overrun", k.name, count);
+        }
+    }
+}
+void test_fill(kernel_set const & k) {
+    for (auto n = 0; n < 40; ++n) {
+        std::vector<uint32_t> got(n + 1, 0xCDCDCDCD), want(n + 1, 0xCDCDCDCD);
+        k.fill(got.data(), 0x12345678, n);
+        fill_scalar(want.data(), 0x12345678, n);
+        check(got == want, "fill", k.name, static_cast<size_t>(n));
+    }
+}
+template <int N> void test_scale(int w, int h) {
+    std::vector<uint8_t> in(static_cast<size_t>(w) * h * 4);
+    for (auto i = size_t{0}; i < in.size(); ++i) in[i] = static_cast<uint8_t>(i * 7 + i / 5);
+    auto const size = static_cast<size_t>(w) * N * h * N * 4;
+    std::vector<uint8_t> got(size), want(size);
+    scale(in.data(), got.data(), w * N, h * N, N);
+    old_scale<N>(in, want, w * N, h * N);
+    check(got == want, "scale", isa(), N);
+}
+}
+}
+}
+
+int main() {
+    using namespace nl::pixels;
+    for (auto const & k : available()) {
+        test_expand(k);
+        test_fill(k);
+    }
+    test_scale<1>(7, 5);
+    test_scale<2>(9, 4);
+    test_scale<3>(5, 6);
+    test_scale<16>(13, 11);
+    if (failures) {
+        std::printf("%d mismatches\n", failures);
+        return 1;
+    }
+    std::printf("Pixel kernels match on %s\n", isa());
+}
@@ -0,0 +1,152 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeWzToNx - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+// Checks that the peak memory of a streaming conversion stays about the same however big the
+// input is, by converting a generated WZ file and one ten times its size
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+extern char ** environ;
+
+namespace {
+// How much the streaming conversions get to use
+unsigned const window = 32;
+// Whatever isn't in the window, such as the code, the buffers of the writer and however much
+// gets touched before the next check
+unsigned const overhead = 32;
+std::string cint(int32_t v) {
+    std::string s;
+    if (v >= -127 && v <= 127) return s.assign(1, static_cast<char>(v));
+    s.push_back(-128);
+    s.append(reinterpret_cast<char const *>(&v), 4);
+    return s;
+}
+std::string int32(int32_t v) { return {reinterpret_cast<char const *>(&v), 4}; }
+// Encrypted with the key that is all zeroes, so only the mask is left
+std::string enc(std::string const & s) {
+    auto r = cint(-static_cast<int32_t>(s.size()));
+    for (auto i = size_t{0}; i < s.size(); ++i)
+        r.push_back(static_cast<char>(s[i] ^ (0xAA + i)));
+    return r;
+}
+std::string prop_string(std::string const & s) { return '\x00' + enc(s); }
+std::string property(std::vector<std::pair<std::string, std::string>> const & children) {
+    auto r = '\x73' + enc("Property") + std::string(2, '\0')
+        + cint(static_cast<int32_t>(children.size()));
+    for (auto & c : children) r += prop_string(c.first) + c.second;
+    return r;
+}
+std::string extended(std::string const & body) {
+    return '\x09' + int32(static_cast<int32_t>(body.size())) + body;
+}
+std::string uol(std::string const & path) {
+    return extended('\x73' + enc("UOL") + '\x00' + prop_string(path));
+}
+// Lots of nodes, strings that are mostly different and UOLs, like the big files have
+std::string img(unsigned n, uint32_t & seed) {
+    std::vector<std::pair<std::string, std::string>> groups;
+    for (auto g = 0u; g < 300; ++g) {
+        std::vector<std::pair<std::string, std::string>> children;
+        for (auto i = 0u; i < 40; ++i) {
+            seed = seed * 1103515245 + 12345;
+            auto name = "n" + std::to_string(n) + "_" + std::to_string(seed >> 16);
+            children.emplace_back(name, '\x03' + cint(static_cast<int32_t>(i)));
+        }
+        for (auto i = 0u; i < 5; ++i) {
+            seed = seed * 1103515245 + 12345;
+            auto path = "../g" + std::to_string((seed >> 16) % 300) + "/" + children[0].first;
+            children.emplace_back("u" + std::to_string(i), uol(path));
+        }
+        auto value = "v" + std::to_string(n) + "_" + std::to_string(g);
+        children.emplace_back("s", '\x08' + prop_string(value));
+        groups.emplace_back("g" + std::to_string(g), extended(property(children)));
+    }
+    return property(groups);
+}
+void write_wz(std::string const & name, unsigned count) {
+    uint32_t seed = 1;
+    std::vector<size_t> sizes;
+    for (auto n = 0u; n < count; ++n) sizes.push_back(img(n, seed).size());
+    auto directory = std::string("\x34\x12", 2) + cint(static_cast<int32_t>(count));
+    for (auto n = 0u; n < count; ++n)
+        directory += '\x04' + enc("img" + std::to_string(n) + ".img")
+            + cint(static_cast<int32_t>(sizes[n])) + cint(0) + int32(0);
+    std::string header{"PKG1"};
+    header += int32(0) + int32(0) + int32(60) + "Package file v1.0 Copyright 2002 Wizet, ZMS";
+    header.resize(60);
+    std::ofstream file{name, std::ios::binary};
+    file << header << directory;
+    // Made again instead of kept, so this process stays small too
+    seed = 1;
+    for (auto n = 0u; n < count; ++n) file << img(n, seed);
+}
+// The peak resident size of converting the file, in MiB
+uint64_t peak(char const * program, std::string const & name) {
+    auto stream = "--stream=" + std::to_string(window);
+    std::vector<char const *> args{program, "-b", "-f", stream.c_str(), name.c_str(), nullptr};
+    // Only whether it worked matters, not what it has to say about it
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    pid_t pid;
+    auto spawned = posix_spawn(&pid, program, &actions, nullptr,
+        const_cast<char * const *>(args.data()), environ) == 0;
+    posix_spawn_file_actions_destroy(&actions);
+    if (!spawned) return 0;
+    int status;
+    rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return 0;
+    // Linux gives it in KiB, macOS in bytes
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss) >> 20;
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) >> 10;
+#endif
+}
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        std::printf("Usage: %s <NoLifeWzToNx>\n", argv[0]);
+        return 2;
+    }
+    write_wz("stream_small.wz", 40);
+    write_wz("stream_big.wz", 400);
+    auto small = peak(argv[1], "stream_small.wz");
+    auto big = peak(argv[1], "stream_big.wz");
+    for (auto name : {"stream_small", "stream_big"})
+        for (auto ext : {".wz", ".nx", ".nxcache"}) std::remove((name + std::string{ext}).c_str());
+    if (small == 0 || big == 0) {
+        std::printf("Conversion failed\n");
+        return 1;
+    }
+    std::printf("Peak of %llu MiB for the small file and %llu MiB for the big one\n",
+        static_cast<unsigned long long>(small), static_cast<unsigned long long>(big));
+    if (big > window + overhead || big > small + overhead) {
+        std::printf("Streaming went over %u MiB\n", window);
+        return 1;
+    }
+}
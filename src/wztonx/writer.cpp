@@ -0,0 +1,248 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeWzToNx - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+#include "writer.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define VC_EXTRALEAN
+#define NOMINMAX
+#include <Windows.h>
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+namespace nl {
+namespace {
+// Alignment required for direct I/O, which is also a good size for anything else
+size_t const alignment = 0x1000;
+size_t const buffer_size = 8 << 20;
+char * allocate() {
+#ifdef _WIN32
+    auto p = _aligned_malloc(buffer_size, alignment);
+#else
+    void * p = nullptr;
+    if (posix_memalign(&p, alignment, buffer_size)) p = nullptr;
+#endif
+    if (!p) throw std::bad_alloc{};
+    return static_cast<char *>(p);
+}
+void deallocate(char * p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+}
+writer::~writer() {
+    try {
+        close();
+    } catch (...) {}
+    for (auto b : m_buffers) deallocate(b);
+}
+void writer::open(std::string const & path, uint64_t reserve, bool direct) {
+    m_path = path;
+    m_direct = direct;
+#ifdef _WIN32
+    DWORD flags = FILE_FLAG_SEQUENTIAL_SCAN;
+    if (direct) flags |= FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH;
+    m_file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+        CREATE_ALWAYS, flags, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) {
+        m_file = nullptr;
+        throw std::runtime_error("Failed to open file " + path);
+    }
+    FILE_ALLOCATION_INFO info{};
+    info.AllocationSize.QuadPart = static_cast<LONGLONG>(reserve);
+    SetFileInformationByHandle(m_file, FileAllocationInfo, &info, sizeof(info));
+#else
+    auto flags = O_RDWR | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+    if (direct) flags |= O_DIRECT;
+#endif
+    m_file = ::open(path.c_str(), flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (m_file == -1 && direct) {
+        // Not every filesystem supports it, so just fall back to normal writes
+        m_direct = false;
+        m_file = ::open(path.c_str(), flags & ~O_DIRECT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    }
+    if (m_file == -1) throw std::runtime_error("Failed to open file " + path);
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+    if (direct) fcntl(m_file, F_NOCACHE, 1);
+#endif
+#ifdef FALLOC_FL_KEEP_SIZE
+    // Failure just means the filesystem can't, which is fine
+    if (reserve) fallocate(m_file, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(reserve));
+#endif
+#endif
+    if (!m_buffers[0]) {
+        m_buffers[0] = allocate();
+        m_buffers[1] = allocate();
+    }
+    m_buffer = m_buffers[0];
+    m_used = 0;
+    m_start = 0;
+}
+void writer::close() {
+#ifdef _WIN32
+    if (!m_file) return;
+#else
+    if (m_file == -1) return;
+#endif
+    auto size = tell();
+    if (m_used) {
+        // Direct writes have to be whole blocks, the excess is trimmed off below
+        auto n = m_used;
+        if (m_direct) {
+            n = (n + alignment - 1) / alignment * alignment;
+            std::memset(m_buffer + m_used, 0, n - m_used);
+        }
+        wait();
+        write_at(m_buffer, n, m_start);
+        m_used = 0;
+    }
+    wait();
+#ifdef _WIN32
+    LARGE_INTEGER end;
+    end.QuadPart = static_cast<LONGLONG>(size);
+    SetFilePointerEx(m_file, end, nullptr, FILE_BEGIN);
+    SetEndOfFile(m_file);
+    CloseHandle(m_file);
+    m_file = nullptr;
+#else
+    auto trimmed = ftruncate(m_file, static_cast<off_t>(size)) == 0;
+    ::close(m_file);
+    m_file = -1;
+    if (!trimmed) throw std::runtime_error("Failed to set the size of file " + m_path);
+#endif
+}
+void writer::write(void const * data, size_t size) {
+    auto p = static_cast<char const *>(data);
+    while (size) {
+        auto n = std::min(size, buffer_size - m_used);
+        std::memcpy(m_buffer + m_used, p, n);
+        m_used += n;
+        p += n;
+        size -= n;
+        if (m_used == buffer_size) flush();
+    }
+}
+void writer::pad_to(uint64_t offset) {
+    if (offset < tell()) throw std::runtime_error("Tried to write backwards in " + m_path);
+    while (tell() < offset) {
+        auto n = static_cast<size_t>(std::min<uint64_t>(offset - tell(), buffer_size - m_used));
+        std::memset(m_buffer + m_used, 0, n);
+        m_used += n;
+        if (m_used == buffer_size) flush();
+    }
+}
+void writer::patch(uint64_t offset, void const * data, size_t size) {
+    if (offset + size > tell()) throw std::runtime_error("Tried to patch past the end of " + m_path);
+    if (offset + size > m_start) {
+        // Whatever is still sitting in the buffer can just be changed there
+        auto skip = static_cast<size_t>(offset < m_start ? m_start - offset : 0);
+        std::memcpy(m_buffer + (offset + skip - m_start), static_cast<char const *>(data) + skip,
+            size - skip);
+        size = skip;
+        if (!size) return;
+    }
+    wait();
+    if (!m_direct) {
+        write_at(static_cast<char const *>(data), size, offset);
+        return;
+    }
+    // Direct writes have to be aligned, so read the surrounding blocks back and rewrite them
+    // using the spare buffer, which is free now that nothing is pending
+    auto spare = m_buffer == m_buffers[0] ? m_buffers[1] : m_buffers[0];
+    auto p = static_cast<char const *>(data);
+    while (size) {
+        auto first = offset / alignment * alignment;
+        auto n = std::min<uint64_t>(buffer_size, (offset + size + alignment - 1) / alignment
+                * alignment - first);
+        auto count = static_cast<size_t>(std::min<uint64_t>(size, first + n - offset));
+        read_at(spare, static_cast<size_t>(n), first);
+        std::memcpy(spare + (offset - first), p, count);
+        write_at(spare, static_cast<size_t>(n), first);
+        offset += count;
+        p += count;
+        size -= count;
+    }
+}
+void writer::flush() {
+    wait();
+    auto full = m_buffer;
+    auto start = m_start;
+    m_pending = std::async(std::launch::async, [this, full, start] {
+        write_at(full, buffer_size, start);
+    });
+    m_buffer = m_buffer == m_buffers[0] ? m_buffers[1] : m_buffers[0];
+    m_start += buffer_size;
+    m_used = 0;
+}
+void writer::wait() {
+    if (m_pending.valid()) m_pending.get();
+}
+void writer::write_at(char const * data, size_t size, uint64_t offset) {
+    while (size) {
+#ifdef _WIN32
+        OVERLAPPED o{};
+        o.Offset = static_cast<DWORD>(offset & 0xffffffff);
+        o.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD n = 0;
+        if (!WriteFile(m_file, data, static_cast<DWORD>(std::min<size_t>(size, 1 << 30)), &n, &o)
+            || n == 0)
+            throw std::runtime_error("Failed to write to file " + m_path);
+#else
+        auto n = ::pwrite(m_file, data, size, static_cast<off_t>(offset));
+        if (n <= 0) throw std::runtime_error("Failed to write to file " + m_path);
+#endif
+        data += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+}
+void writer::read_at(char * data, size_t size, uint64_t offset) {
+    // Reading past the end of what was written so far just leaves zeros
+    std::memset(data, 0, size);
+    while (size) {
+#ifdef _WIN32
+        OVERLAPPED o{};
+        o.Offset = static_cast<DWORD>(offset & 0xffffffff);
+        o.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD n = 0;
+        if (!ReadFile(m_file, data, static_cast<DWORD>(size), &n, &o) || n == 0) return;
+#else
+        auto n = ::pread(m_file, data, size, static_cast<off_t>(offset));
+        if (n <= 0) return;
+#endif
+        data += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+}
+}
@@ -0,0 +1,67 @@
+//////////////////////////////////////////////////////////////////////////////
+// NoLifeWzToNx - Part of the NoLifeStory project                           //
+// Copyright © 2014 Peter Atashian                                          //
+//                                                                          //
+// This program is free software: you can redistribute it and/or modify     //
+// it under the terms of the GNU Affero General Public License as           //
+// published by the Free Software Foundation, either version 3 of the       //
+// License, or (at your option) any later version.                          //
+//                                                                          //
+// This program is distributed in the hope that it will be useful,          //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of           //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            //
+// GNU Affero General Public License for more details.                      //
+//                                                                          //
+// You should have received a copy of the GNU Affero General Public License //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.    //
+//////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <string>
+
+namespace nl {
+// Writes a file front to back through large aligned buffers, one of which is being written out
+// while the other is filled. Earlier bytes can still be patched, which is applied directly to the
+// file since it is only done for small tables.
+class writer {
+public:
+    writer() = default;
+    writer(writer const &) = delete;
+    writer & operator=(writer const &) = delete;
+    ~writer();
+    // Preallocates reserve bytes if the filesystem supports it, the file is trimmed to what was
+    // actually written when closed. Direct bypasses the OS cache where that is supported.
+    void open(std::string const & path, uint64_t reserve, bool direct);
+    void close();
+    uint64_t tell() const { return m_start + m_used; }
+    void write(void const * data, size_t size);
+    template <typename T>
+    void write(T const & v) {
+        write(&v, sizeof(T));
+    }
+    // Writes zeros up to the given offset, which can't be behind tell()
+    void pad_to(uint64_t offset);
+    // Overwrites bytes that were already written
+    void patch(uint64_t offset, void const * data, size_t size);
+
+private:
+    void flush();
+    void wait();
+    void write_at(char const * data, size_t size, uint64_t offset);
+    void read_at(char * data, size_t size, uint64_t offset);
+    std::string m_path;
+    char * m_buffers[2] = {nullptr, nullptr};
+    char * m_buffer = nullptr;
+    size_t m_used = 0;
+    uint64_t m_start = 0;
+    bool m_direct = false;
+    std::future<void> m_pending;
+#ifdef _WIN32
+    void * m_file = nullptr;
+#else
+    int m_file = -1;
+#endif
+};
+}
@@ -35,12 +35,22 @@
 
 #include <squish.h>
 
+#include "cache.hpp"
+#include "codec.hpp"
+#include "crypto.hpp"
+#include "filter.hpp"
+#include "pixels.hpp"
+#include "spill.hpp"
+#include "writer.hpp"
+
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
 #ifndef NL_NO_CODECVT
 #include <codecvt>
 #endif
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
 #ifndef NL_NO_STD_FILESYSTEM
@@ -51,14 +61,21 @@ namespace sys = std::experimental::filesystem;
 namespace sys = boost::filesystem;
 #endif
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <locale>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <numeric>
 #include <regex>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace {
@@ -69,6 +86,28 @@ std::string u8string(const sys::path & path) {
     return path.native();
 #endif
 }
+// Sorts each of the given number of slices on its own thread, then merges them pairwise
+template <typename It, typename Cmp>
+void parallel_sort(It first, It last, Cmp cmp, unsigned threads) {
+    auto size = static_cast<size_t>(last - first);
+    auto count = std::max<size_t>(std::min<size_t>(threads, size / 0x10000), 1);
+    std::vector<It> bounds;
+    for (auto i = size_t{0}; i <= count; ++i) bounds.push_back(first + size * i / count);
+    std::vector<std::thread> workers;
+    for (auto i = size_t{1}; i < count; ++i)
+        workers.emplace_back([&, i] { std::sort(bounds[i], bounds[i + 1], cmp); });
+    std::sort(bounds[0], bounds[1], cmp);
+    for (auto & w : workers) w.join();
+    for (auto step = size_t{1}; step < count; step *= 2) {
+        workers.clear();
+        for (auto i = size_t{0}; i + step < count; i += step * 2) {
+            auto mid = bounds[i + step];
+            auto end = bounds[std::min(i + step * 2, count)];
+            workers.emplace_back([&, i, mid, end] { std::inplace_merge(bounds[i], mid, end, cmp); });
+        }
+        for (auto & w : workers) w.join();
+    }
+}
 }
 
 using namespace std::string_literals;
@@ -78,98 +117,46 @@ namespace nl {
 // Some typedefs
 typedef char char8_t;
 typedef uint32_t id_t;
-typedef uint8_t key_t;
 typedef int32_t int_t;
-// The keys
-// TODO - Use AES to generate these keys at runtime
-extern key_t key_bms[65536];
-extern key_t key_gms[65536];
-extern key_t key_kms[65536];
-key_t const * keys[3] = {key_bms, key_gms, key_kms};
-// Tables for color lookups
-uint8_t const table4[0x10] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
-0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
-uint8_t const table5[0x20] = {0x00, 0x08, 0x10, 0x19, 0x21, 0x29, 0x31, 0x3A, 0x42, 0x4A, 0x52,
-0x5A, 0x63, 0x6B, 0x73, 0x7B, 0x84, 0x8C, 0x94, 0x9C, 0xA5, 0xAD,
-0xB5, 0xBD, 0xC5, 0xCE, 0xD6, 0xDE, 0xE6, 0xEF, 0xF7, 0xFF};
-uint8_t const table6[0x40] = {
-    0x00, 0x04, 0x08, 0x0C, 0x10, 0x14, 0x18, 0x1C, 0x20, 0x24, 0x28, 0x2D, 0x31, 0x35, 0x39, 0x3D,
-    0x41, 0x45, 0x49, 0x4D, 0x51, 0x55, 0x59, 0x5D, 0x61, 0x65, 0x69, 0x6D, 0x71, 0x75, 0x79, 0x7D,
-    0x82, 0x86, 0x8A, 0x8E, 0x92, 0x96, 0x9A, 0x9E, 0xA2, 0xA6, 0xAA, 0xAE, 0xB2, 0xB6, 0xBA, 0xBE,
-    0xC2, 0xC6, 0xCA, 0xCE, 0xD2, 0xD7, 0xDB, 0xDF, 0xE3, 0xE7, 0xEB, 0xEF, 0xF3, 0xF7, 0xFB, 0xFF};
-// cp1252 table
-char16_t const cp1252[0x100] = {
-    0x0000, 0x0001, 0x0002, 0x0003, 0x0004, 0x0005, 0x0006, 0x0007, 0x0008, 0x0009, 0x000A, 0x000B,
-    0x000C, 0x000D, 0x000E, 0x000F, 0x0010, 0x0011, 0x0012, 0x0013, 0x0014, 0x0015, 0x0016, 0x0017,
-    0x0018, 0x0019, 0x001A, 0x001B, 0x001C, 0x001D, 0x001E, 0x001F, 0x0020, 0x0021, 0x0022, 0x0023,
-    0x0024, 0x0025, 0x0026, 0x0027, 0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
-    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037, 0x0038, 0x0039, 0x003A, 0x003B,
-    0x003C, 0x003D, 0x003E, 0x003F, 0x0040, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
-    0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F, 0x0050, 0x0051, 0x0052, 0x0053,
-    0x0054, 0x0055, 0x0056, 0x0057, 0x0058, 0x0059, 0x005A, 0x005B, 0x005C, 0x005D, 0x005E, 0x005F,
-    0x0060, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067, 0x0068, 0x0069, 0x006A, 0x006B,
-    0x006C, 0x006D, 0x006E, 0x006F, 0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
-    0x0078, 0x0079, 0x007A, 0x007B, 0x007C, 0x007D, 0x007E, 0x007F, 0x20AC, 0xFFFD, 0x201A, 0x0192,
-    0x201E, 0x2026, 0x2020, 0x2021, 0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0xFFFD, 0x017D, 0xFFFD,
-    0xFFFD, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014, 0x02DC, 0x2122, 0x0161, 0x203A,
-    0x0153, 0xFFFD, 0x017E, 0x0178, 0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7,
-    0x00A8, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF, 0x00B0, 0x00B1, 0x00B2, 0x00B3,
-    0x00B4, 0x00B5, 0x00B6, 0x00B7, 0x00B8, 0x00B9, 0x00BA, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0x00BF,
-    0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7, 0x00C8, 0x00C9, 0x00CA, 0x00CB,
-    0x00CC, 0x00CD, 0x00CE, 0x00CF, 0x00D0, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
-    0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x00DD, 0x00DE, 0x00DF, 0x00E0, 0x00E1, 0x00E2, 0x00E3,
-    0x00E4, 0x00E5, 0x00E6, 0x00E7, 0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
-    0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7, 0x00F8, 0x00F9, 0x00FA, 0x00FB,
-    0x00FC, 0x00FD, 0x00FE, 0x00FF};
 // Identity operation because C++ doesn't have such a template. Surprising, I know.
 template <typename T>
 struct identity {
     T const & operator()(T const & v) const { return v; }
 };
 
-template <int N> void scale(std::vector<uint8_t> const & input, std::vector<uint8_t> & output, int width, int height) {
-    auto in = reinterpret_cast<uint32_t const *>(input.data());
-    auto out = reinterpret_cast<uint32_t *>(output.data());
-    auto w = width / N;
-    auto h = height / N;
-    for (auto y = 0; y < h; ++y) {
-        for (auto x = 0; x < w; ++x) {
-            auto p = in[y * w + x];
-            for (auto yy = y * N; yy < (y + 1) * N; ++yy) {
-                for (auto xx = x * N; xx < (x + 1) * N; ++xx) {
-                    out[yy * width + xx] = p;
-                }
-            }
-        }
-    }
-}
 // Input memory mapped file
 struct imapfile {
     char const * base = nullptr;
     char const * offset = nullptr;
+    size_t file_size = 0;
 #ifdef _WIN32
     void * file_handle = nullptr;
     void * map_handle = nullptr;
     void open(std::string p) {
-        file_handle = CreateFileA(p.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
-            FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        file_handle = CreateFileA(p.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+            nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
         if (file_handle == INVALID_HANDLE_VALUE)
             throw std::runtime_error("Failed to open file " + p);
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file_handle, &size))
+            throw std::runtime_error("Failed to obtain file information of file " + p);
+        file_size = static_cast<size_t>(size.QuadPart);
         map_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
         if (map_handle == nullptr)
             throw std::runtime_error("Failed to create file mapping of file " + p);
         base = reinterpret_cast<char *>(MapViewOfFile(map_handle, FILE_MAP_READ, 0, 0, 0));
         if (base == nullptr) throw std::runtime_error("Failed to map view of file " + p);
         offset = base;
+        track(base, file_size);
     }
     ~imapfile() {
+        if (base) untrack(base);
         UnmapViewOfFile(base);
         CloseHandle(map_handle);
         CloseHandle(file_handle);
     }
 #else
     int file_handle = 0;
-    size_t file_size = 0;
     void open(std::string p) {
         file_handle = ::open(p.c_str(), O_RDONLY);
         if (file_handle == -1) throw std::runtime_error("Failed to open file " + p);
@@ -182,8 +169,10 @@ struct imapfile {
         if (reinterpret_cast<intptr_t>(base) == -1)
             throw std::runtime_error("Failed to create memory mapping of file " + p);
         offset = base;
+        track(base, file_size);
     }
     ~imapfile() {
+        if (base) untrack(base);
         munmap(const_cast<char *>(base), file_size);
         close(file_handle);
     }
@@ -202,68 +191,6 @@ struct imapfile {
         return a != -128 ? a : read<int32_t>();
     }
 };
-// Output memory mapped file
-struct omapfile {
-    char * base = nullptr;
-    char * offset = nullptr;
-#ifdef _WIN32
-    void * file_handle = nullptr;
-    void * map_handle = nullptr;
-    void open(std::string p, size_t size) {
-        file_handle
-            = ::CreateFileA(p.c_str(), GENERIC_READ | GENERIC_WRITE,
-                FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, CREATE_ALWAYS, 0, nullptr);
-        if (file_handle == INVALID_HANDLE_VALUE)
-            throw std::runtime_error("Failed to open file " + p);
-        map_handle = ::CreateFileMappingA(file_handle, nullptr, PAGE_READWRITE, size >> 32,
-            size & 0xffffffff, nullptr);
-        if (map_handle == nullptr)
-            throw std::runtime_error("Failed to create file mapping of file " + p);
-        base = reinterpret_cast<char *>(::MapViewOfFile(map_handle, FILE_MAP_ALL_ACCESS, 0, 0, 0));
-        if (base == nullptr) throw std::runtime_error("Failed to map view of file " + p);
-        offset = base;
-    }
-    ~omapfile() {
-        ::UnmapViewOfFile(base);
-        ::CloseHandle(map_handle);
-        ::CloseHandle(file_handle);
-    }
-#else
-    int file_handle = 0;
-    size_t file_size = 0;
-    void open(std::string p, uint64_t size) {
-        file_handle
-            = ::open(p.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-        if (file_handle == -1) throw std::runtime_error("Failed to open file " + p);
-        file_size = size;
-        if (::lseek(file_handle, file_size - 1, SEEK_SET) == -1)
-            throw std::runtime_error("Error calling lseek() to 'stretch' file " + p);
-        if (::write(file_handle, "", 1) != 1)
-            throw std::runtime_error("Error writing last byte of file " + p);
-        base = reinterpret_cast<char *>(
-            ::mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, file_handle, 0));
-        if (reinterpret_cast<intptr_t>(base) == -1)
-            throw std::runtime_error("Failed to create memory mapping of file " + p);
-        offset = base;
-    }
-    void close() {
-        ::munmap(const_cast<char *>(base), file_size);
-        ::close(file_handle);
-    }
-#endif
-    size_t tell() { return static_cast<size_t>(offset - base); }
-    void seek(size_t n) { offset = base + n; }
-    void skip(size_t n) { offset += n; }
-    template <typename T>
-    void write(T const & v) {
-        *reinterpret_cast<T *>(offset) = v;
-        offset += sizeof(T);
-    }
-    void write(void const * buf, size_t size) {
-        std::memcpy(offset, buf, size);
-        offset += size;
-    }
-};
 // Node stuff
 #pragma pack(push, 1)
 struct node {
@@ -304,34 +231,220 @@ struct audio {
 };
 struct bitmap {
     uint64_t data;
-    uint8_t const * key;
+    crypto::key const * key;
+};
+// A string in the string table, only valid until the next string is added
+struct string_ref {
+    char const * ptr;
+    size_t len;
+    size_t size() const { return len; }
+    char operator[](size_t i) const { return ptr[i]; }
+    string_ref substr(size_t pos, size_t n = std::string::npos) const {
+        return {ptr + pos, std::min(n, len - pos)};
+    }
+    std::string str() const { return {ptr, len}; }
+};
+bool operator<(string_ref a, string_ref b) {
+    auto r = std::memcmp(a.ptr, b.ptr, std::min(a.len, b.len));
+    return r != 0 ? r < 0 : a.len < b.len;
+}
+bool operator==(string_ref a, string_ref b) {
+    return a.len == b.len && std::memcmp(a.ptr, b.ptr, a.len) == 0;
+}
+bool operator!=(string_ref a, string_ref b) { return !(a == b); }
+bool operator==(string_ref a, char const * b) { return a == string_ref{b, std::strlen(b)}; }
+// All the strings packed back to back instead of one allocation each
+class string_table {
+public:
+    void spill(std::string const & dir) {
+        m_chars.spill(dir);
+        m_entries.spill(dir);
+    }
+    size_t size() const { return m_entries.size(); }
+    void reserve(size_t n) { m_entries.reserve(n); }
+    // Total length of all the strings
+    uint64_t length() const { return m_chars.size(); }
+    string_ref operator[](size_t n) const {
+        auto & e = m_entries[n];
+        return {m_chars.data() + e.offset, e.length};
+    }
+    void push_back(std::string const & s) {
+        m_entries.push_back({m_chars.size(), static_cast<uint32_t>(s.size())});
+        m_chars.append(s.data(), s.size());
+    }
+
+private:
+    struct entry {
+        uint64_t offset;
+        uint32_t length;
+    };
+    spill_vector<char> m_chars;
+    spill_vector<entry> m_entries;
+};
+// Paths of node ids packed back to back, the same way as the strings
+class path_table {
+public:
+    struct path {
+        id_t const * ptr;
+        size_t len;
+        size_t size() const { return len; }
+        id_t operator[](size_t i) const { return ptr[i]; }
+        id_t back() const { return ptr[len - 1]; }
+        id_t const * begin() const { return ptr; }
+        id_t const * end() const { return ptr + len; }
+    };
+    void spill(std::string const & dir) {
+        m_ids.spill(dir);
+        m_ends.spill(dir);
+    }
+    size_t size() const { return m_ends.size(); }
+    void reserve(size_t n) { m_ends.reserve(n); }
+    path operator[](size_t n) const {
+        auto first = n == 0 ? 0 : m_ends[n - 1];
+        return {m_ids.data() + first, static_cast<size_t>(m_ends[n] - first)};
+    }
+    void push_back(std::vector<id_t> const & p) {
+        m_ids.append(p.data(), p.size());
+        m_ends.push_back(m_ids.size());
+    }
+
+private:
+    spill_vector<id_t> m_ids;
+    spill_vector<uint64_t> m_ends;
+};
+// Which entry goes with a node, as a sorted list instead of a hash table so it can be spilled too
+class node_index {
+public:
+    static uint32_t const none = ~0u;
+    node_index() = default;
+    explicit node_index(std::string const & dir) : m_entries{dir} {}
+    void spill(std::string const & dir) { m_entries.spill(dir); }
+    size_t size() const { return m_entries.size(); }
+    void clear() { m_entries.clear(); }
+    void add(id_t id, uint32_t value) { m_entries.push_back({id, value}); }
+    // Has to be done after adding and before finding
+    void sort() {
+        std::sort(m_entries.begin(), m_entries.end(), [](entry const & a, entry const & b) {
+            return a.id != b.id ? a.id < b.id : a.value < b.value;
+        });
+    }
+    // The lowest value added for the node, or none if there isn't one
+    uint32_t find(id_t id) const {
+        auto it = std::lower_bound(m_entries.begin(), m_entries.end(), id,
+            [](entry const & e, id_t i) { return e.id < i; });
+        return it != m_entries.end() && it->id == id ? it->value : none;
+    }
+
+private:
+    struct entry {
+        id_t id;
+        uint32_t value;
+    };
+    spill_vector<entry> m_entries;
+};
+// What the first pass of streaming counts, to size the tables before anything goes in them. The
+// strings are counted every time they appear, so that is only an upper bound.
+struct table_sizes {
+    uint64_t nodes = 1;
+    uint64_t strings = 1;
+    uint64_t bitmaps = 0;
+    uint64_t audios = 0;
+    uint64_t uols = 0;
 };
 // The main class itself
 struct wztonx {
     // Variables
     imapfile in;
-    omapfile out;
-    std::vector<node> nodes = std::vector<node>{{node{}}};
-    std::vector<std::pair<id_t, id_t>> nodes_to_sort;
-    std::unordered_map<uint32_t, id_t, identity<uint32_t>> string_map;
-    std::vector<std::string> strings;
+    writer out;
+    spill_vector<node> nodes;
+    // A range of children, which get sorted by name
+    struct child_range {
+        id_t first;
+        id_t count;
+    };
+    spill_vector<child_range> nodes_to_sort;
+    // Open addressed from the hashes of the strings to their ids, where id 0 means a free slot
+    struct string_slot {
+        uint32_t hash;
+        id_t id;
+    };
+    spill_vector<string_slot> string_map;
+    // How big the string index can get. Past that strings only get matched to what is still in
+    // it, and the rest get added again.
+    size_t string_slots = std::numeric_limits<size_t>::max();
+    string_table strings;
     std::string str_buf;
+    std::string u8str_buf;
     std::u16string wstr_buf;
 #ifndef NL_NO_CODECVT
     std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>, wchar_t> convert;
 #endif
-    char8_t const * u8key = nullptr;
-    char16_t const * u16key = nullptr;
-    std::vector<std::pair<id_t, int32_t>> imgs;
+    crypto::key const * key = nullptr;
+    // Every img with its size, in the order of their node ids since each directory's children are
+    // added after everything that came before
+    struct img_entry {
+        id_t node;
+        int32_t size;
+    };
+    spill_vector<img_entry> imgs;
     size_t file_start = 0;
     std::vector<id_t> uol_path;
-    std::vector<std::vector<id_t>> uols;
-    std::vector<bitmap> bitmaps;
-    std::vector<audio> audios;
+    path_table uols;
+    enum class link : uint8_t { pending, active, resolved, failed, deferred };
+    spill_vector<link> uol_state;
+    node_index uol_index;
+    // Canvases can take their bitmap from somewhere else with a path in a "source", "_inlink" or
+    // "_outlink" string, and maps can have another map loaded in their place with info/link
+    path_table refs;
+    spill_vector<bool> ref_maps;
+    spill_vector<link> ref_state;
+    node_index ref_index;
+    // How many threads to resolve UOLs with
+    unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+    spill_vector<bitmap> bitmaps;
+    spill_vector<audio> audios;
     size_t offset, node_offset, string_offset, string_table_offset, bitmap_offset,
         bitmap_table_offset, audio_offset, audio_table_offset;
     bool client, hc;
-    std::string wzfilename, nxfilename;
+    std::string wzfilename, nxfilename, cachefilename;
+    // The output is written here and only replaces the NX file once it is complete
+    std::string tempfilename;
+    // Whether to skip files the .nxcache says are up to date and reuse their bitmaps
+    bool use_cache = true;
+    // How much memory to keep the conversion within by going over the input twice, first just to
+    // size the tables, and keeping everything that grows with the input in temporary files. 0 to
+    // hold it all in memory.
+    uint64_t window = 0;
+    // Where those temporary files go, empty while the tables are in memory
+    std::string spill_dir;
+    // Whether to write the output bypassing the OS cache
+    bool direct = false;
+    // Whether to store bitmaps block compressed, so they can be uploaded to the GPU as is
+    bool blocks = false;
+    // How many downscaled levels to store after each bitmap, and how many that adds up to. They
+    // go in the bitmap table after all the bitmaps themselves.
+    unsigned mips = 0;
+    size_t level_count = 0;
+    // Which codecs bitmaps get compressed with, and how hard zstd tries
+    codec::policy policy = codec::policy::lz4;
+    int zstd_level = 12;
+    // Which nodes to leave out of the output
+    filter rules;
+    // Paths of the nodes and bitmaps a trace saw used, in the order it first saw them, with
+    // whether it was the bitmap that got used
+    std::vector<std::pair<bool, std::string>> order;
+    // The order to write the string data and bitmaps in by id, empty for the order of their ids
+    spill_vector<uint32_t> string_order;
+    spill_vector<uint32_t> bitmap_order;
+    // Roughly how much space the compressed bitmaps will take up, to preallocate
+    uint64_t bitmap_estimate = 0;
+    cache::manifest manifest;
+    // The previous NX file, to copy unchanged bitmaps from
+    std::unique_ptr<imapfile> previous;
+    cache::manifest previous_manifest;
+    // Where progress and problems get reported, buffered per file when converting in parallel
+    std::ostream & progress;
+    std::ostream & log;
     // Methods
     std::string convert_str(std::u16string const & p_str) {
 #ifndef NL_NO_CODECVT
@@ -344,107 +457,266 @@ struct wztonx {
         return{buf.data(), size};
 #endif
     }
-    id_t add_string(std::string str) {
+    id_t add_string(std::string const & str) {
         uint32_t hash = 2166136261u;
         for (auto c : str) {
             hash ^= c;
             hash *= 16777619u;
         }
-        auto & id = string_map[hash];
-        if (id != 0) return id;
-        id = static_cast<id_t>(strings.size());
-        strings.push_back(std::move(str));
-        return id;
+        // Kept no more than half full, until it can't grow any more
+        if (strings.size() * 2 >= string_map.size() && string_map.size() < string_slots)
+            resize_string_map(std::max<size_t>(string_map.size() * 2, 0x10000));
+        auto capped = string_map.size() >= string_slots;
+        auto mask = string_map.size() - 1;
+        auto i = hash & mask;
+        for (auto n = 0u; string_map[i].id != 0; i = (i + 1) & mask) {
+            if (string_map[i].hash == hash) return string_map[i].id;
+            // Once it is full, a string takes the place of whatever was in its first slot
+            if (capped && ++n == 8) {
+                i = hash & mask;
+                break;
+            }
+        }
+        auto & slot = string_map[i];
+        slot = {hash, static_cast<id_t>(strings.size())};
+        strings.push_back(str);
+        return slot.id;
     }
-    id_t read_enc_string() {
+    void resize_string_map(size_t size) {
+        spill_vector<string_slot> map{spill_dir};
+        map.resize(size);
+        for (auto & slot : string_map) {
+            if (slot.id == 0) continue;
+            auto i = slot.hash & (size - 1);
+            while (map[i].id != 0) i = (i + 1) & (size - 1);
+            map[i] = slot;
+        }
+        string_map.swap(map);
+    }
+    // Decrypts the string at the cursor into one of the buffers, giving nullptr if it is empty
+    std::string const * decode_enc_string() {
         auto len = in.read<int8_t>();
         if (len > 0) {
             auto slen = len == 127 ? in.read<uint32_t>() : len;
             auto ows = reinterpret_cast<char16_t const *>(in.offset);
             in.skip(slen * 2u);
-            auto mask = 0xAAAAu;
-            wstr_buf.resize(slen);
-            for (auto i = 0u; i < std::min(slen, 0x10000u); ++i) {
-                wstr_buf[i] = static_cast<char16_t>(ows[i] ^ u16key[i] ^ mask);
-                ++mask;
-            }
-            for (auto i = 0x10000u; i < slen; ++i) {
-                wstr_buf[i] = static_cast<char16_t>(ows[i] ^ mask);
-                ++mask;
+            crypto::decrypt(wstr_buf, ows, slen, *key);
+            if (crypto::is_ascii(wstr_buf.data(), wstr_buf.size())) {
+                crypto::narrow(str_buf, wstr_buf.data(), wstr_buf.size());
+                return &str_buf;
             }
-            return add_string(convert_str(wstr_buf));
+            u8str_buf = convert_str(wstr_buf);
+            return &u8str_buf;
         }
         if (len < 0) {
             auto slen = len == -128 ? in.read<uint32_t>() : -len;
             auto os = reinterpret_cast<char8_t const *>(in.offset);
             in.skip(slen);
-            auto mask = 0xAAu;
-            str_buf.resize(slen);
-            for (auto i = 0u; i < std::min(slen, 0x10000u); ++i) {
-                str_buf[i] = static_cast<char8_t>(os[i] ^ u8key[i] ^ mask);
-                ++mask;
-            }
-            for (auto i = 0x10000u; i < slen; ++i) {
-                str_buf[i] = static_cast<char8_t>(os[i] ^ mask);
-                ++mask;
+            crypto::decrypt(str_buf, os, slen, *key);
+            if (!crypto::is_ascii(str_buf.data(), str_buf.size())) {
+                crypto::cp1252_to_utf8(u8str_buf, str_buf.data(), str_buf.size());
+                return &u8str_buf;
             }
-            if (std::any_of(str_buf.begin(), str_buf.end(),
-                [](char const & c) { return static_cast<uint8_t>(c) >= 0x80; })) {
-                std::transform(str_buf.cbegin(), str_buf.cend(), std::back_inserter(wstr_buf),
-                    [](char c) { return cp1252[static_cast<unsigned char>(c)]; });
-                return add_string(convert_str(wstr_buf));
-            }
-            return add_string(str_buf);
+            return &str_buf;
         }
-        return 0;
+        return nullptr;
     }
-    id_t read_prop_string(size_t p_offset) {
+    id_t read_enc_string() {
+        auto s = decode_enc_string();
+        return s ? add_string(*s) : 0;
+    }
+    std::string const * decode_prop_string(size_t p_offset) {
         auto a = in.read<uint8_t>();
         switch (a) {
         case 0x00:
-        case 0x73: return read_enc_string();
+        case 0x73: return decode_enc_string();
         case 0x01:
         case 0x1B:
         {
             auto o = in.read<int32_t>() + p_offset;
             auto p = in.tell();
             in.seek(o);
-            auto s = read_enc_string();
+            auto s = decode_enc_string();
             in.seek(p);
             return s;
         }
         default: throw std::runtime_error("Unknown property string type: " + std::to_string(a));
         }
     }
+    id_t read_prop_string(size_t p_offset) {
+        auto s = decode_prop_string(p_offset);
+        return s ? add_string(*s) : 0;
+    }
+    void skip_enc_string() {
+        auto len = in.read<int8_t>();
+        if (len > 0) in.skip((len == 127 ? in.read<uint32_t>() : len) * 2u);
+        if (len < 0) in.skip(len == -128 ? in.read<uint32_t>() : -len);
+    }
+    void skip_prop_string() {
+        auto a = in.read<uint8_t>();
+        switch (a) {
+        case 0x00:
+        case 0x73: skip_enc_string(); break;
+        case 0x01:
+        case 0x1B: in.skip(4); break;
+        default: throw std::runtime_error("Unknown property string type: " + std::to_string(a));
+        }
+    }
     void deduce_key() {
         auto len = in.read<int8_t>();
         if (len >= 0) throw std::runtime_error("I give up");
         auto slen = len == -128 ? in.read<uint32_t>() : -len;
-        u8key = nullptr;
-        for (auto key : keys) {
-            auto os = reinterpret_cast<char8_t const *>(in.offset);
-            uint8_t mask = 0xAA;
-            auto k = reinterpret_cast<char8_t const *>(key);
-            bool valid = true;
-            for (auto i = 0u; i < slen; ++i, ++mask) {
-                auto c = static_cast<uint8_t>(os[i] ^ k[i] ^ mask);
-                if (c < 0x20 || c >= 0x80) {
-                    valid = false;
-                }
+        auto valid = [&](crypto::key const & k) {
+            crypto::decrypt(str_buf, in.offset, slen, k);
+            return std::all_of(str_buf.begin(), str_buf.end(), [](char c) {
+                return static_cast<uint8_t>(c) >= 0x20 && static_cast<uint8_t>(c) < 0x80;
+            });
+        };
+        // A short string can decode as printable under more than one key, in which case the
+        // last locale wins
+        key = nullptr;
+        for (auto i = crypto::locales().size(); i-- > 0 && !key;) {
+            auto & k = crypto::get_key(i);
+            if (valid(k)) key = &k;
+        }
+        if (!key) throw std::runtime_error("Failed to identify the locale");
+        in.skip(slen);
+    }
+    // Works out which nodes the filter drops, along with everything under them
+    void find_dropped(id_t id, std::vector<std::string> & path, spill_vector<bool> & dropped) {
+        auto & n = nodes[id];
+        for (auto i = 0u; i < n.num; ++i) {
+            auto child = n.children + i;
+            auto & c = nodes[child];
+            path.push_back(strings[c.name].str());
+            if (rules.keep(path, static_cast<uint16_t>(c.data_type))) {
+                find_dropped(child, path, dropped);
+            } else {
+                drop(child, dropped);
             }
-            if (valid) {
-                u8key = reinterpret_cast<char8_t const *>(key);
-                u16key = reinterpret_cast<char16_t const *>(key);
+            path.pop_back();
+        }
+    }
+    void drop(id_t id, spill_vector<bool> & dropped) {
+        dropped[id] = true;
+        auto & n = nodes[id];
+        for (auto i = 0u; i < n.num; ++i) drop(n.children + i, dropped);
+    }
+    // Removes whatever the filter drops. Everything after a dropped node just moves down, so
+    // children stay contiguous and in the order they were parsed in. Bitmaps and audio nobody
+    // refers to anymore are left out as well.
+    void prune() {
+        spill_vector<bool> dropped{spill_dir};
+        dropped.assign(nodes.size(), false);
+        std::vector<std::string> path;
+        find_dropped(0, path, dropped);
+        // Where each node ends up, with one past the end so ranges of children can be mapped
+        spill_vector<id_t> remap{spill_dir};
+        remap.resize(nodes.size() + 1);
+        auto kept = id_t{0};
+        for (auto i = size_t{0}; i < nodes.size(); ++i) {
+            remap[i] = kept;
+            if (!dropped[i]) ++kept;
+        }
+        remap[nodes.size()] = kept;
+        auto total = nodes.size();
+        if (kept == total) return;
+        for (auto i = size_t{0}; i < total; ++i) {
+            if (dropped[i]) continue;
+            auto n = nodes[i];
+            if (n.num != 0) {
+                auto first = remap[n.children];
+                n.num = static_cast<uint16_t>(remap[n.children + n.num] - first);
+                n.children = n.num != 0 ? first : 0;
             }
+            nodes[remap[i]] = n;
         }
-        if (!u8key) throw std::runtime_error("Failed to identify the locale");
-        in.skip(slen);
+        nodes.resize(kept);
+        auto blocks = size_t{0};
+        for (auto & b : nodes_to_sort) {
+            auto first = remap[b.first];
+            auto count = remap[b.first + b.count] - first;
+            if (count != 0) nodes_to_sort[blocks++] = {first, count};
+        }
+        nodes_to_sort.resize(blocks);
+        imgs.resize(static_cast<size_t>(std::remove_if(imgs.begin(), imgs.end(),
+            [&](img_entry const & img) { return dropped[img.node]; }) - imgs.begin()));
+        for (auto & img : imgs) img.node = remap[img.node];
+        // Nothing has been resolved yet, so every bitmap and audio belongs to exactly one node
+        spill_vector<id_t> bitmap_ids{spill_dir}, audio_ids{spill_dir};
+        bitmap_ids.assign(bitmaps.size() + 1, 0);
+        audio_ids.assign(audios.size() + 1, 0);
+        for (auto i = size_t{0}; i < nodes.size(); ++i) {
+            auto & n = nodes[i];
+            if (n.data_type == node::type::bitmap) bitmap_ids[n.data.bitmap.id] = 1;
+            if (n.data_type == node::type::audio) audio_ids[n.data.audio.id] = 1;
+        }
+        auto renumber = [](spill_vector<id_t> & ids) {
+            auto next = id_t{0};
+            for (auto & id : ids) {
+                auto used = id;
+                id = next;
+                next += used;
+            }
+            return ids.back();
+        };
+        auto bitmap_count = renumber(bitmap_ids);
+        auto audio_count = renumber(audio_ids);
+        level_count = 0;
+        for (auto i = size_t{0}; i < nodes.size(); ++i) {
+            auto & n = nodes[i];
+            if (n.data_type == node::type::bitmap) {
+                n.data.bitmap.id = bitmap_ids[n.data.bitmap.id];
+                level_count += codec::levels(n.data.bitmap.width, n.data.bitmap.height, mips);
+            } else if (n.data_type == node::type::audio) {
+                n.data.audio.id = audio_ids[n.data.audio.id];
+            }
+        }
+        // Going in order means nothing gets overwritten before it has been moved
+        for (auto i = size_t{0}; i < bitmaps.size(); ++i)
+            if (bitmap_ids[i + 1] != bitmap_ids[i]) bitmaps[bitmap_ids[i]] = bitmaps[i];
+        for (auto i = size_t{0}; i < audios.size(); ++i)
+            if (audio_ids[i + 1] != audio_ids[i]) audios[audio_ids[i]] = audios[i];
+        bitmaps.resize(bitmap_count);
+        audios.resize(audio_count);
+        progress << std::dec << total - kept << " nodes dropped...";
+        log << "Dropped " << std::dec << total - kept << " of " << total << " nodes in "
+            << wzfilename << std::endl;
     }
-    void sort_nodes(id_t first, id_t count) {
-        std::sort(nodes.begin() + first, nodes.begin() + first + count,
-            [this](node const & n1, node const & n2) {
-            return strings[n1.name] < strings[n2.name];
-        });
+    // Sorts all the children by name. The strings are ranked once, so the children themselves
+    // can be sorted by comparing integers rather than strings.
+    void sort_nodes() {
+        // Ranking the strings jumps all over them, so streaming compares the names themselves
+        // and only ever looks at the strings of one node's children at a time
+        if (window) {
+            for (auto & r : nodes_to_sort) {
+                auto first = nodes.begin() + r.first;
+                std::sort(first, first + r.count, [this](node const & n1, node const & n2) {
+                    return strings[n1.name] < strings[n2.name];
+                });
+            }
+            return;
+        }
+        std::vector<uint32_t> order(strings.size());
+        std::iota(order.begin(), order.end(), 0u);
+        parallel_sort(order.begin(), order.end(),
+            [this](uint32_t a, uint32_t b) { return strings[a] < strings[b]; }, threads);
+        std::vector<uint32_t> rank(order.size());
+        for (auto i = size_t{0}; i < order.size(); ++i) rank[order[i]] = static_cast<uint32_t>(i);
+        std::atomic<size_t> next{0};
+        auto work = [&] {
+            for (auto i = next++; i < nodes_to_sort.size(); i = next++) {
+                auto first = nodes.begin() + nodes_to_sort[i].first;
+                std::sort(first, first + nodes_to_sort[i].count,
+                    [&rank](node const & n1, node const & n2) {
+                    return rank[n1.name] < rank[n2.name];
+                });
+            }
+        };
+        std::vector<std::thread> workers;
+        for (auto i = 1u; i < threads && i < nodes_to_sort.size(); ++i) workers.emplace_back(work);
+        work();
+        for (auto & w : workers) w.join();
     }
     void find_uols(id_t uol_node) {
         auto & n = nodes[uol_node];
@@ -452,60 +724,299 @@ struct wztonx {
             uol_path.push_back(uol_node);
             uols.push_back(uol_path);
             uol_path.pop_back();
-        } else if (n.num != 0) {
+            return;
+        }
+        if (n.data_type == node::type::string || n.data_type == node::type::integer) {
+            auto name = strings[n.name];
+            if (n.data_type == node::type::string &&
+                (name == "source" || name == "_inlink" || name == "_outlink")) {
+                uol_path.push_back(uol_node);
+                refs.push_back(uol_path);
+                ref_maps.push_back(false);
+                uol_path.pop_back();
+            } else if (name == "link" && is_map_info(uol_path)) {
+                uol_path.push_back(uol_node);
+                refs.push_back(uol_path);
+                ref_maps.push_back(true);
+                uol_path.pop_back();
+            }
+        }
+        if (n.num != 0) {
             uol_path.push_back(uol_node);
             for (auto i = 0u; i < n.num; ++i) find_uols(n.children + i);
             uol_path.pop_back();
         }
     }
-    id_t get_child(id_t parent_node, std::string const & str) {
+    // Whether a path ends in the info of a map, as in Map/Map1/100000000.img/info
+    bool is_map_info(std::vector<id_t> const & path) {
+        if (path.size() < 3) return false;
+        if (!(strings[nodes[path.back()].name] == "info")) return false;
+        auto img = strings[nodes[path[path.size() - 2]].name];
+        if (img.size() != 13 || !(img.substr(9) == ".img")) return false;
+        for (auto i = size_t{0}; i < 9; ++i)
+            if (img[i] < '0' || img[i] > '9') return false;
+        auto dir = strings[nodes[path[path.size() - 3]].name];
+        return dir == "Map" || (dir.size() == 4 && dir.substr(0, 3) == "Map");
+    }
+    id_t get_child(id_t parent_node, string_ref str) {
         if (parent_node == 0) return 0;
+        return find_child(parent_node, str);
+    }
+    // Unlike get_child this can look in the root, so 0 only means it wasn't found
+    id_t find_child(id_t parent_node, string_ref str) {
         auto & n = nodes[parent_node];
         auto first = nodes.begin() + n.children;
         auto last = first + n.num;
-        auto it = std::lower_bound(first, last, str, [this](node const & n, std::string const & s) {
+        auto it = std::lower_bound(first, last, str, [this](node const & n, string_ref s) {
             return strings[n.name] < s;
         });
         if (it == last) return 0;
         if (strings[it->name] != str) return 0;
         return static_cast<id_t>(it - nodes.begin());
     }
-    bool resolve_uol(std::vector<id_t> uol) {
-        auto & n = nodes[uol.back()];
-        uol.pop_back();
-        if (n.data_type != node::type::uol) throw std::runtime_error("Welp. I failed.");
-        auto & s = strings[n.data.string];
-        auto b = 0u;
-        for (auto i = 0u; i < s.size(); ++i)
-            if (s[i] == '/') {
-                if (i - b == 2 && s[b] == '.' && s[b + 1] == '.')
-                    uol.pop_back();
-                else
-                    uol.push_back(get_child(uol.back(), s.substr(b, i - b)));
-                b = ++i;
+    // Resolves a UOL along with any UOLs it passes through or points at, each of which is only
+    // ever resolved once. Resolving anything that would have to leave the img at depth floor of the
+    // path is deferred, which lets imgs be resolved in parallel.
+    link resolve_uol(uint32_t index, size_t floor) {
+        auto & state = uol_state[index];
+        // Running into a UOL that is still being resolved means there is a cycle
+        if (state == link::active) return link::failed;
+        if (state != link::pending) return state;
+        state = link::active;
+        auto stored = uols[index];
+        std::vector<id_t> path{stored.begin(), stored.end()};
+        auto & n = nodes[path.back()];
+        path.pop_back();
+        auto done = [&](link result) {
+            // Deferred ones get another go later, from scratch
+            uol_state[index] = result == link::deferred ? link::pending : result;
+            return result;
+        };
+        auto child = [&](string_ref name) {
+            auto parent = path.back();
+            auto it = uol_index.find(parent);
+            if (it != node_index::none) {
+                auto r = resolve_uol(it, floor);
+                if (r == link::deferred) return r;
             }
-        uol.push_back(get_child(uol.back(), s.substr(b)));
-        if (uol.back() == 0) return false;
-        auto & nr = nodes[uol.back()];
-        if (nr.data_type == node::type::uol) return false;
+            path.push_back(get_child(parent, name));
+            return link::resolved;
+        };
+        auto s = strings[n.data.string];
+        auto b = size_t{0};
+        for (auto i = size_t{0}; i < s.size(); ++i) {
+            if (s[i] != '/') continue;
+            auto part = s.substr(b, i - b);
+            b = i + 1;
+            if (part == "..") {
+                if (floor && path.size() <= floor + 1) return done(link::deferred);
+                path.pop_back();
+                if (path.empty()) return done(link::failed);
+            } else if (child(part) == link::deferred) {
+                return done(link::deferred);
+            }
+        }
+        if (child(s.substr(b)) == link::deferred) return done(link::deferred);
+        auto target = path.back();
+        if (target == 0) return done(link::failed);
+        auto it = uol_index.find(target);
+        if (it != node_index::none) {
+            auto r = resolve_uol(it, floor);
+            if (r != link::resolved) return done(r);
+        }
+        auto & nr = nodes[target];
         n.data_type = nr.data_type;
         n.children = nr.children;
         n.num = nr.num;
         n.data.integer = nr.data.integer;
-        return true;
-    }
-    void uol_fail(std::vector<id_t> & uol) {
-        //std::cerr << "Invalid UOL: ";
-        //for (auto id : uol) {
-            //auto & n = nodes[id];
-            //std::cerr << '/' << strings[n.name];
-        //}
-        auto & n = nodes[uol.back()];
-        if (n.data_type == node::type::uol) {
-            //std::cerr << " = \"" << strings[n.data.string] << "\"" << std::endl;
+        return done(link::resolved);
+    }
+    // Where the img is in imgs, or imgs.size() if the node isn't one
+    size_t find_img(id_t id) const {
+        auto it = std::lower_bound(imgs.begin(), imgs.end(), id,
+            [](img_entry const & img, id_t i) { return img.node < i; });
+        return it != imgs.end() && it->node == id ? static_cast<size_t>(it - imgs.begin())
+                                                  : imgs.size();
+    }
+    void resolve_uols() {
+        uol_state.assign(uols.size(), link::pending);
+        uol_index.clear();
+        for (auto i = size_t{0}; i < uols.size(); ++i)
+            uol_index.add(uols[i].back(), static_cast<uint32_t>(i));
+        uol_index.sort();
+        // UOLs almost never leave their img, so every img can be resolved independently. The
+        // UOLs are sorted by the img they are in, with the ones that aren't in any going last.
+        spill_vector<uint32_t> groups{spill_dir}, floors{spill_dir}, starts{spill_dir},
+            members{spill_dir};
+        groups.resize(uols.size());
+        floors.assign(imgs.size() + 1, 0);
+        starts.assign(imgs.size() + 2, 0);
+        for (auto i = size_t{0}; i < uols.size(); ++i) {
+            auto path = uols[i];
+            auto group = imgs.size();
+            for (auto d = size_t{0}; d < path.size(); ++d) {
+                auto img = find_img(path[d]);
+                if (img == imgs.size()) continue;
+                group = img;
+                floors[group] = static_cast<uint32_t>(d);
+                break;
+            }
+            groups[i] = static_cast<uint32_t>(group);
+            ++starts[group + 1];
+        }
+        for (auto g = size_t{0}; g <= imgs.size(); ++g) starts[g + 1] += starts[g];
+        members.resize(uols.size());
+        std::iota(members.begin(), members.end(), 0u);
+        std::sort(members.begin(), members.end(), [&groups](uint32_t a, uint32_t b) {
+            return groups[a] != groups[b] ? groups[a] < groups[b] : a < b;
+        });
+        // The last group is left to the final pass
+        std::atomic<size_t> next{0};
+        auto work = [&] {
+            for (auto g = next++; g < imgs.size(); g = next++)
+                for (auto m = starts[g]; m < starts[g + 1]; ++m)
+                    resolve_uol(members[m], floors[g]);
+        };
+        auto count = std::min<size_t>(std::max(threads, 1u), imgs.size());
+        std::vector<std::thread> workers;
+        for (auto i = size_t{1}; i < count; ++i) workers.emplace_back(work);
+        work();
+        for (auto & w : workers) w.join();
+        // Whatever had to leave its img is done here without any restrictions
+        for (auto i = size_t{0}; i < uols.size(); ++i) resolve_uol(static_cast<uint32_t>(i), 0);
+        auto resolved = size_t{0};
+        for (auto i = size_t{0}; i < uols.size(); ++i) {
+            if (uol_state[i] == link::resolved) {
+                ++resolved;
+                continue;
+            }
             // If we failed to resolve any uols, just turn them into useless empty nodes
-            n.data_type = node::type::none;
-        } else { std::cerr << " claims to be an invalid UOL but isn't a UOL???" << std::endl; }
+            nodes[uols[i].back()].data_type = node::type::none;
+        }
+        progress << std::dec << resolved << " links resolved, " << uols.size() - resolved
+                 << " failed...";
+        log << "Resolved " << std::dec << resolved << " of " << uols.size() << " links in "
+            << wzfilename << std::endl;
+    }
+    // Follows a path of child names, giving 0 if any of them doesn't exist
+    id_t descend(id_t from, string_ref path) {
+        auto b = size_t{0};
+        for (auto i = size_t{0}; i <= path.size(); ++i) {
+            if (i != path.size() && path[i] != '/') continue;
+            auto part = path.substr(b, i - b);
+            b = i + 1;
+            if (part.size() == 0) continue;
+            from = find_child(from, part);
+            if (from == 0) return 0;
+        }
+        return from;
+    }
+    // Finds what a reference points at, the same way the client would look it up
+    id_t find_reference(uint32_t index) {
+        auto path = refs[index];
+        auto & n = nodes[path.back()];
+        if (ref_maps[index]) {
+            auto name = n.data_type == node::type::integer ? std::to_string(n.data.integer)
+                                                           : strings[n.data.string].str();
+            if (name.empty() || name.size() > 9) return 0;
+            name.insert(0, 9 - name.size(), '0');
+            name += ".img";
+            auto img = string_ref{name.data(), name.size()};
+            // Either every map is in the same directory, or they are split up by first digit
+            auto target = find_child(path[path.size() - 4], img);
+            if (target != 0 || path.size() < 5) return target;
+            auto dir = std::string("Map") + name[0];
+            auto d = find_child(path[path.size() - 5], string_ref{dir.data(), dir.size()});
+            return d == 0 ? 0 : find_child(d, img);
+        }
+        auto s = strings[n.data.string];
+        if (strings[n.name] == "_inlink") {
+            // Relative to the img the canvas is in
+            auto from = id_t{0};
+            for (auto id : path)
+                if (find_img(id) != imgs.size()) from = id;
+            return descend(from, s);
+        }
+        // These start with the name of the file, which is left out just like the client does
+        auto b = size_t{0};
+        while (b < s.size() && s[b] != '/') ++b;
+        return descend(0, b < s.size() ? s.substr(b + 1) : s);
+    }
+    // Turns a reference into an alias of what it points at, after resolving any reference the
+    // target has itself. A canvas with a reference gets the bitmap it points at, while a map with
+    // a link becomes the map it links to.
+    link resolve_reference(uint32_t index) {
+        auto & state = ref_state[index];
+        if (state == link::active) return link::failed;
+        if (state != link::pending) return state;
+        state = link::active;
+        auto done = [&](link result) {
+            ref_state[index] = result;
+            return result;
+        };
+        auto path = refs[index];
+        auto map = ref_maps[index];
+        auto owner = path[path.size() - (map ? 3 : 2)];
+        auto target = find_reference(index);
+        if (target == 0 || target == owner) return done(link::failed);
+        auto it = ref_index.find(target);
+        if (it != node_index::none) resolve_reference(it);
+        auto & nt = nodes[target];
+        auto & no = nodes[owner];
+        if (map) {
+            no.data_type = nt.data_type;
+            no.children = nt.children;
+            no.num = nt.num;
+            no.data.integer = nt.data.integer;
+            return done(link::resolved);
+        }
+        if (nt.data_type != node::type::bitmap) return done(link::failed);
+        // Only the bitmap is taken, since the target's children could lead back here
+        auto & n = nodes[path.back()];
+        n.data_type = nt.data_type;
+        n.data.integer = nt.data.integer;
+        if (no.data_type == node::type::bitmap || no.data_type == node::type::none) {
+            no.data_type = node::type::bitmap;
+            no.data.integer = nt.data.integer;
+        }
+        return done(link::resolved);
+    }
+    void resolve_references() {
+        ref_state.assign(refs.size(), link::pending);
+        ref_index.clear();
+        for (auto i = size_t{0}; i < refs.size(); ++i) {
+            auto path = refs[i];
+            ref_index.add(path[path.size() - (ref_maps[i] ? 3 : 2)], static_cast<uint32_t>(i));
+        }
+        ref_index.sort();
+        auto resolved = size_t{0};
+        for (auto i = size_t{0}; i < refs.size(); ++i)
+            if (resolve_reference(static_cast<uint32_t>(i)) == link::resolved) ++resolved;
+        // UOLs were resolved first so references can go through them, which means any UOL
+        // pointing at a canvas that just got a new bitmap still has the old one. Canvases are
+        // told apart by their children, since no two of them share any.
+        node_index canvases{spill_dir};
+        for (auto i = size_t{0}; i < refs.size(); ++i) {
+            if (ref_maps[i] || ref_state[i] != link::resolved) continue;
+            auto path = refs[i];
+            auto owner = path[path.size() - 2];
+            canvases.add(nodes[owner].children, owner);
+        }
+        canvases.sort();
+        if (canvases.size() != 0) {
+            for (auto i = size_t{0}; i < uols.size(); ++i) {
+                auto & n = nodes[uols[i].back()];
+                if (n.num == 0) continue;
+                auto owner = canvases.find(n.children);
+                if (owner == node_index::none) continue;
+                n.data_type = nodes[owner].data_type;
+                n.data.integer = nodes[owner].data.integer;
+            }
+        }
+        progress << std::dec << resolved << " references resolved, " << refs.size() - resolved
+                 << " failed...";
+        log << "Resolved " << std::dec << resolved << " of " << refs.size() << " references in "
+            << wzfilename << std::endl;
     }
     void directory(id_t dir_node) {
         std::vector<id_t> directories;
@@ -541,16 +1052,16 @@ struct wztonx {
             if (type == 3)
                 directories.push_back(ni + i);
             else if (type == 4)
-                imgs.emplace_back(ni + i, size);
+                imgs.push_back({ni + i, size});
             else
                 throw std::runtime_error("Unknown type 2 directory");
         }
         for (auto it : directories) directory(it);
-        nodes_to_sort.emplace_back(ni, count);
+        nodes_to_sort.push_back({ni, count});
     }
     void extended_property(id_t prop_node, size_t p_offset) {
         auto & n = nodes[prop_node];
-        auto & st = strings[read_prop_string(p_offset)];
+        auto st = strings[read_prop_string(p_offset)];
         if (st == "Property") {
             in.skip(2);
             sub_property(prop_node, p_offset);
@@ -565,9 +1076,23 @@ struct wztonx {
             auto & nn = nodes[prop_node];
             nn.data_type = node::type::bitmap;
             nn.data.bitmap.id = static_cast<uint32_t>(bitmaps.size());
-            bitmaps.push_back({in.tell(), reinterpret_cast<uint8_t const *>(u8key)});
-            nn.data.bitmap.width = static_cast<uint16_t>(in.read_cint());
-            nn.data.bitmap.height = static_cast<uint16_t>(in.read_cint());
+            bitmaps.push_back({in.tell(), key});
+            auto width = in.read_cint();
+            auto height = in.read_cint();
+            nn.data.bitmap.width = static_cast<uint16_t>(width);
+            nn.data.bitmap.height = static_cast<uint16_t>(height);
+            // LZ4 usually ends up within twice the size of the zlib data it replaces
+            auto p = in.tell();
+            in.read_cint();
+            in.skip(5);
+            auto length = in.read<uint32_t>();
+            in.seek(p);
+            auto pixels = static_cast<uint64_t>(std::max(width, 0)) * std::max(height, 0);
+            auto estimate = std::min<uint64_t>(pixels * 4, length * 2ull) + 4;
+            auto levels = codec::levels(width, height, mips);
+            level_count += levels;
+            // Each level is a quarter of the one before
+            bitmap_estimate += levels ? estimate + estimate / 3 : estimate;
         } else if (st == "Shape2D#Vector2D") {
             n.data_type = node::type::vector;
             n.data.vector[0] = in.read_cint();
@@ -584,7 +1109,7 @@ struct wztonx {
                 nn.name = add_string(std::move(es));
                 extended_property(ni, p_offset);
             }
-            nodes_to_sort.emplace_back(ni, count);
+            nodes_to_sort.push_back({ni, count});
         } else if (st == "Sound_DX8") {
             n.data_type = node::type::audio;
             n.data.audio.id = static_cast<uint32_t>(audios.size());
@@ -599,7 +1124,7 @@ struct wztonx {
             in.skip(1);
             n.data_type = node::type::uol;
             n.data.string = read_prop_string(p_offset);
-        } else { throw std::runtime_error("Unknown sub property type: " + st); }
+        } else { throw std::runtime_error("Unknown sub property type: " + st.str()); }
     }
     void sub_property(id_t prop_node, size_t p_offset) {
         auto & n = nodes[prop_node];
@@ -662,7 +1187,7 @@ struct wztonx {
             default: throw std::runtime_error("Unknown sub property type: " + std::to_string(type));
             }
         }
-        nodes_to_sort.emplace_back(ni, count);
+        nodes_to_sort.push_back({ni, count});
     }
     void img(id_t img_node, int32_t size) {
         auto p = in.tell();
@@ -681,20 +1206,154 @@ struct wztonx {
         if (slen > 0x1ffff) throw std::runtime_error("Lua script is too long");
         auto os = reinterpret_cast<char8_t const *>(in.offset);
         str_buf.resize(slen);
-        auto key = key_kms;
-        u8key = reinterpret_cast<char8_t const *>(key);
-        for (auto i = 0u; i < slen; ++i) {
-            str_buf[i] = static_cast<char8_t>(os[i] ^ u8key[i]);
-        }
+        key = &crypto::get_key("KMS");
+        crypto::xor_bytes(&str_buf[0], os, key->raw.data(), slen);
         auto string = add_string(str_buf);
         auto & n = nodes[script_node];
         n.data_type = node::type::string;
         n.data.string = string;
     }
-    virtual void parse_file() {
-        std::cerr << "Working on " << wzfilename << std::endl;
-        std::cout << "Parsing input.......";
-        in.open(wzfilename);
+    // The first pass of streaming, which goes over everything the same way as parsing does, just
+    // counting instead of storing anything
+    void count_directory(table_sizes & sizes, spill_vector<int32_t> & img_sizes) {
+        auto count = static_cast<uint64_t>(in.read_cint());
+        sizes.nodes += count;
+        sizes.strings += count;
+        auto directories = uint64_t{0};
+        for (auto i = uint64_t{0}; i < count; ++i) {
+            auto type = in.read<uint8_t>();
+            switch (type) {
+            case 1: throw std::runtime_error("Found the elusive type 1 directory");
+            case 2:
+            {
+                auto s = in.read<int32_t>();
+                auto p = in.tell();
+                in.seek(file_start + s);
+                type = in.read<uint8_t>();
+                in.seek(p);
+                break;
+            }
+            case 3:
+            case 4: skip_enc_string(); break;
+            default: throw std::runtime_error("Unknown directory type");
+            }
+            auto size = in.read_cint();
+            if (size < 0) throw std::runtime_error("Directory/img has invalid size!");
+            in.read_cint();
+            in.skip(4);
+            if (type == 3)
+                ++directories;
+            else if (type == 4)
+                img_sizes.push_back(size);
+            else
+                throw std::runtime_error("Unknown type 2 directory");
+        }
+        // The subdirectories follow one after another, in the same order as their entries
+        for (auto i = uint64_t{0}; i < directories; ++i) count_directory(sizes, img_sizes);
+    }
+    void count_extended(table_sizes & sizes, size_t p_offset) {
+        auto s = decode_prop_string(p_offset);
+        auto st = s ? *s : std::string{};
+        ++sizes.strings;
+        if (st == "Property") {
+            in.skip(2);
+            count_sub(sizes, p_offset);
+        } else if (st == "Canvas") {
+            in.skip(1);
+            if (in.read<uint8_t>() == 1) {
+                in.skip(2);
+                count_sub(sizes, p_offset);
+            }
+            ++sizes.bitmaps;
+            in.read_cint();
+            in.read_cint();
+        } else if (st == "Shape2D#Vector2D") {
+            in.read_cint();
+            in.read_cint();
+        } else if (st == "Shape2D#Convex2D") {
+            auto count = static_cast<uint64_t>(in.read_cint());
+            sizes.nodes += count;
+            sizes.strings += count;
+            for (auto i = uint64_t{0}; i < count; ++i) count_extended(sizes, p_offset);
+        } else if (st == "Sound_DX8") {
+            ++sizes.audios;
+            in.skip(1);
+            in.read_cint();
+            in.read_cint();
+        } else if (st == "UOL") {
+            ++sizes.uols;
+            ++sizes.strings;
+            in.skip(1);
+            skip_prop_string();
+        } else { throw std::runtime_error("Unknown sub property type: " + st); }
+    }
+    void count_sub(table_sizes & sizes, size_t p_offset) {
+        auto count = static_cast<uint64_t>(in.read_cint());
+        sizes.nodes += count;
+        sizes.strings += count;
+        for (auto i = uint64_t{0}; i < count; ++i) {
+            skip_prop_string();
+            auto type = in.read<uint8_t>();
+            switch (type) {
+            case 0x00: break;
+            case 0x0B:
+            case 0x02: in.skip(2); break;
+            case 0x03:
+            case 0x13: in.read_cint(); break;
+            case 0x04:
+                if (in.read<uint8_t>() == 0x80) in.skip(4);
+                break;
+            case 0x05: in.skip(8); break;
+            case 0x08:
+                ++sizes.strings;
+                skip_prop_string();
+                break;
+            case 0x09:
+            {
+                auto size = in.read<int32_t>();
+                auto p = in.tell() + size;
+                count_extended(sizes, p_offset);
+                in.seek(p);
+                break;
+            }
+            case 0x14:
+                if (in.read<uint8_t>() == 0x80) in.skip(8);
+                break;
+            default: throw std::runtime_error("Unknown sub property type: " + std::to_string(type));
+            }
+        }
+    }
+    void count_img(table_sizes & sizes, int32_t size) {
+        auto p = in.tell();
+        if (in.read<uint8_t>() == 1) {
+            ++sizes.strings;
+        } else {
+            deduce_key();
+            in.seek(p);
+            count_extended(sizes, p);
+        }
+        in.seek(p + size);
+    }
+    virtual table_sizes count_file() {
+        progress << "Sizing tables.......";
+        table_sizes sizes;
+        read_header();
+        spill_vector<int32_t> img_sizes{spill_dir};
+        count_directory(sizes, img_sizes);
+        for (auto size : img_sizes) count_img(sizes, size);
+        progress << std::dec << sizes.nodes << " nodes...Done!" << std::endl;
+        return sizes;
+    }
+    void reserve_tables(table_sizes const & sizes) {
+        nodes.reserve(sizes.nodes);
+        strings.reserve(sizes.strings);
+        bitmaps.reserve(sizes.bitmaps);
+        audios.reserve(sizes.audios);
+        uols.reserve(sizes.uols);
+        uol_state.reserve(sizes.uols);
+    }
+    void read_header() {
+        in.seek(0);
         auto magic = in.read<uint32_t>();
         if (magic != 0x31474B50) throw std::runtime_error("Not a valid WZ file");
         in.skip(8);
@@ -705,24 +1364,112 @@ struct wztonx {
         in.skip(1);
         deduce_key();
         in.seek(file_start + 2);
+    }
+    virtual void parse_file() {
+        log << "Working on " << wzfilename << std::endl;
+        progress << "Parsing input.......";
+        read_header();
         add_string({});
         directory(0);
-        for (auto & it : imgs) img(it.first, it.second);
+        for (auto & it : imgs) img(it.node, it.size);
         finish_parse();
     }
     void finish_parse() {
-        for (auto const & n : nodes_to_sort) sort_nodes(n.first, n.second);
+        if (!rules.empty()) prune();
+        sort_nodes();
         find_uols(0);
-        for (;;) {
-            auto it = std::remove_if(uols.begin(), uols.end(), [this](std::vector<id_t> const & v) {
-                return resolve_uol(v);
-            });
-            auto diff = uols.end() - it;
-            uols.erase(it, uols.end());
-            if (diff == 0) break;
+        resolve_uols();
+        resolve_references();
+        if (!order.empty()) reorder();
+        progress << "Done!" << std::endl;
+    }
+    // Lays the file out in the order the trace used things, so whatever gets used together is
+    // read together. Blocks of children have to stay together and in order, but the blocks
+    // themselves can go anywhere, so the ones anything in the trace is in go first. The string
+    // data and bitmaps keep their ids and only get written in a different order.
+    void reorder() {
+        std::vector<id_t> used;
+        std::vector<uint32_t> used_bitmaps;
+        for (auto & o : order) {
+            auto id = descend(0, string_ref{o.second.data(), o.second.size()});
+            if (id == 0 && !o.second.empty()) continue;
+            if (!o.first) {
+                used.push_back(id);
+            } else if (nodes[id].data_type == node::type::bitmap) {
+                used_bitmaps.push_back(nodes[id].data.bitmap.id);
+            }
+        }
+        // Anything not in the trace comes afterwards in the order it was already in
+        auto arrange = [this](spill_vector<uint32_t> & result,
+                              std::vector<uint32_t> const & first, size_t count) {
+            spill_vector<bool> placed{spill_dir};
+            placed.assign(count, false);
+            result.clear();
+            result.reserve(count);
+            for (auto i : first) {
+                if (placed[i]) continue;
+                placed[i] = true;
+                result.push_back(i);
+            }
+            for (auto i = size_t{0}; i < count; ++i)
+                if (!placed[i]) result.push_back(static_cast<uint32_t>(i));
+        };
+        std::vector<uint32_t> used_strings;
+        for (auto id : used) {
+            used_strings.push_back(nodes[id].name);
+            if (nodes[id].data_type == node::type::string)
+                used_strings.push_back(nodes[id].data.string);
+        }
+        arrange(string_order, used_strings, strings.size());
+        arrange(bitmap_order, used_bitmaps, bitmaps.size());
+        spill_vector<child_range> blocks{spill_dir};
+        for (auto & b : nodes_to_sort)
+            if (b.count != 0) blocks.push_back(b);
+        std::sort(blocks.begin(), blocks.end(),
+            [](child_range const & a, child_range const & b) {
+            return a.first != b.first ? a.first < b.first : a.count < b.count;
+        });
+        std::vector<uint32_t> used_blocks;
+        for (auto id : used) {
+            if (id == 0) continue;
+            auto it = std::upper_bound(blocks.begin(), blocks.end(), id,
+                [](id_t i, child_range const & b) { return i < b.first; });
+            used_blocks.push_back(static_cast<uint32_t>(it - blocks.begin() - 1));
+        }
+        spill_vector<uint32_t> block_order{spill_dir};
+        arrange(block_order, used_blocks, blocks.size());
+        // The root stays where it is
+        spill_vector<id_t> remap{spill_dir};
+        remap.resize(nodes.size());
+        auto next = id_t{1};
+        for (auto b : block_order)
+            for (auto i = id_t{0}; i < blocks[b].count; ++i) remap[blocks[b].first + i] = next++;
+        if (next != nodes.size())
+            throw std::runtime_error("Not every node is in a block of children");
+        for (auto i = size_t{0}; i < nodes.size(); ++i) {
+            auto & n = nodes[i];
+            if (n.num != 0) n.children = remap[n.children];
+        }
+        // Move every node to its new place by following each cycle of the permutation around
+        spill_vector<bool> moved{spill_dir};
+        moved.assign(nodes.size(), false);
+        for (auto i = size_t{0}; i < nodes.size(); ++i) {
+            if (moved[i]) continue;
+            moved[i] = true;
+            auto carry = nodes[i];
+            auto j = remap[i];
+            while (!moved[j]) {
+                moved[j] = true;
+                std::swap(carry, nodes[j]);
+                j = remap[j];
+            }
+            nodes[j] = carry;
         }
-        for (auto & it : uols) uol_fail(it);
-        std::cout << "Done!" << std::endl;
+        nodes_to_sort.clear();
+        progress << std::dec << used.size() + used_bitmaps.size() << " of " << order.size()
+                 << " traced...";
+        log << "Laid out " << std::dec << used.size() << " nodes and " << used_bitmaps.size()
+            << " bitmaps of " << order.size() << " traced in " << wzfilename << std::endl;
     }
     void calculate_offsets() {
         offset = 0;
@@ -735,10 +1482,9 @@ struct wztonx {
         offset += strings.size() * 8;
         offset += 0x10 - (offset & 0xf);
         string_offset = offset;
-        offset += std::accumulate(strings.begin(), strings.end(), 0ull,
-            [](size_t n, std::string const & s) {
-            return n + s.size() + 2 + (s.size() & 1 ? 1 : 0);
-        });
+        offset += strings.length() + strings.size() * 2;
+        for (auto i = size_t{0}; i < strings.size(); ++i)
+            if (strings[i].size() & 1) ++offset;
         offset += 0x10 - (offset & 0xf);
         audio_table_offset = offset;
         if (client) {
@@ -747,7 +1493,7 @@ struct wztonx {
         }
         bitmap_table_offset = offset;
         if (client) {
-            offset += bitmaps.size() * 8;
+            offset += (bitmaps.size() + level_count) * 8;
             offset += 0x10 - (offset & 0xf);
         }
         audio_offset = offset;
@@ -759,17 +1505,16 @@ struct wztonx {
         bitmap_offset = offset;
     }
     void open_output() {
-        std::cout << "Opening output......";
+        progress << "Opening output......";
         calculate_offsets();
-        out.open(nxfilename, offset);
-        out.seek(0);
+        out.open(tempfilename, client ? offset + bitmap_estimate : offset, direct);
         out.write<uint32_t>(0x34474B50);
         out.write<uint32_t>(static_cast<uint32_t>(nodes.size()));
         out.write<uint64_t>(node_offset);
         out.write<uint32_t>(static_cast<uint32_t>(strings.size()));
         out.write<uint64_t>(string_table_offset);
         if (client) {
-            out.write<uint32_t>(static_cast<uint32_t>(bitmaps.size()));
+            out.write<uint32_t>(static_cast<uint32_t>(bitmaps.size() + level_count));
             out.write<uint64_t>(bitmap_table_offset);
             out.write<uint32_t>(static_cast<uint32_t>(audios.size()));
             out.write<uint64_t>(audio_table_offset);
@@ -779,228 +1524,430 @@ struct wztonx {
             out.write<uint32_t>(0);
             out.write<uint64_t>(0);
         }
-        std::cout << "Done!" << std::endl;
+        progress << "Done!" << std::endl;
     }
     void write_nodes() {
-        std::cout << "Writing nodes.......";
-        out.seek(node_offset);
+        progress << "Writing nodes.......";
+        out.pad_to(node_offset);
         out.write(nodes.data(), nodes.size() * 20);
-        std::cout << "Done!" << std::endl;
+        progress << "Done!" << std::endl;
     }
     void write_strings() {
-        std::cout << "Writing strings.....";
-        out.seek(string_table_offset);
+        progress << "Writing strings.....";
+        out.pad_to(string_table_offset);
+        auto at = [this](size_t n) { return string_order.empty() ? n : string_order[n]; };
+        spill_vector<uint64_t> table{spill_dir};
+        table.resize(strings.size());
         auto next_str = string_offset;
-        for (auto const & s : strings) {
-            out.write<uint64_t>(next_str);
+        for (auto n = size_t{0}; n < strings.size(); ++n) {
+            auto s = strings[at(n)];
+            table[at(n)] = next_str;
             next_str += s.size() + 2;
             if (s.size() & 1) ++next_str;
         }
-        out.seek(string_offset);
-        for (auto const & s : strings) {
+        out.write(table.data(), table.size() * 8);
+        out.pad_to(string_offset);
+        for (auto n = size_t{0}; n < strings.size(); ++n) {
+            auto s = strings[at(n)];
             out.write<uint16_t>(static_cast<uint16_t>(s.size()));
-            out.write(s.data(), s.size());
-            if (s.size() & 1) out.skip(1);
+            out.write(s.ptr, s.size());
+            if (s.size() & 1) out.write<uint8_t>(0);
         }
-        std::cout << "Done!" << std::endl;
+        progress << "Done!" << std::endl;
     }
     void write_audio() {
-        std::cout << "Writing audio.......";
-        out.seek(audio_table_offset);
+        progress << "Writing audio.......";
+        out.pad_to(audio_table_offset);
         auto audio_off = audio_offset;
         for (auto & a : audios) {
             out.write<uint64_t>(audio_off);
             audio_off += a.length;
         }
-        out.seek(audio_offset);
+        // This skips over the bitmap table, which is filled in once the bitmaps are written
+        out.pad_to(audio_offset);
         for (auto & a : audios) out.write(in.base + a.data, a.length);
-        std::cout << "Done!" << std::endl;
+        progress << "Done!" << std::endl;
+    }
+    // A canvas as stored in the WZ file
+    struct canvas {
+        int32_t width, height, f1;
+        unsigned f2;
+        uint32_t length;
+        uint8_t const * data;
+    };
+    canvas read_canvas(bitmap const & b) {
+        in.seek(b.data);
+        canvas c;
+        c.width = in.read_cint();
+        c.height = in.read_cint();
+        if (c.width < 0 || c.height < 0) {
+            log << "Invalid image size: " << std::dec << c.width << ", " << c.height << std::endl;
+            throw std::runtime_error{"fak"};
+        }
+        c.f1 = in.read_cint();
+        c.f2 = static_cast<unsigned>(in.read<uint8_t>()); // Cast away from char to preserve sanity
+        auto n1 = in.read<uint32_t>();
+        if (n1) {
+            log << "non-zero n1: "
+                << "0x" << std::setfill('0') << std::setw(8) << std::hex << n1;
+            throw std::runtime_error{"fak"};
+        }
+        c.length = in.read<uint32_t>();
+        auto n2 = static_cast<unsigned>(in.read<uint8_t>());
+        if (n2) {
+            log << "non-zero n2: "
+                << " 0x" << std::setfill('0') << std::setw(2) << std::hex
+                << n2 << std::endl;
+            throw std::runtime_error{"fak"};
+        }
+        c.data = reinterpret_cast<uint8_t const *>(in.offset);
+        return c;
+    }
+    // Decodes a canvas into BGRA8888 pixels at the start of input, output being scratch space.
+    // With keep_dxt, DXT3 canvases are kept as BC2 with red and blue swapped in the endpoints,
+    // so they decode to the same pixels as the BGRA path gives.
+    codec::format decode_canvas(canvas const & c, crypto::key const * key,
+        std::vector<uint8_t> & input, std::vector<uint8_t> & output, size_t index,
+        bool keep_dxt) {
+        auto size = c.width * c.height * 4;
+        auto length = c.length;
+        auto f1 = c.f1;
+        auto f2 = c.f2;
+        auto biggest = std::max(static_cast<uint32_t>(size), length);
+        input.resize(biggest);
+        output.resize(biggest);
+        auto decompressed = 0;
+        auto decompress = [&] {
+            z_stream strm = {};
+            strm.next_in = input.data();
+            strm.avail_in = length;
+            inflateInit(&strm);
+            strm.next_out = output.data();
+            strm.avail_out = static_cast<unsigned>(output.size());
+            auto err = inflate(&strm, Z_FINISH);
+            if (err != Z_BUF_ERROR) {
+                if (err != Z_DATA_ERROR) { log << "zlib error of " << std::dec << err << std::endl; }
+                return false;
+            }
+            decompressed = static_cast<int>(strm.total_out);
+            inflateEnd(&strm);
+            return true;
+        };
+        auto decrypt = [&] {
+            auto p = 0u;
+            for (auto i = 0u; i <= length - 4;) {
+                auto blen = *reinterpret_cast<uint32_t const *>(c.data + i);
+                i += 4;
+                if (i + blen > length) return false;
+                auto klen = std::min<size_t>(blen, key->raw.size());
+                crypto::xor_bytes(input.data() + p, c.data + i, key->raw.data(), klen);
+                std::copy(c.data + i + klen, c.data + i + blen, input.begin() + p + klen);
+                i += blen;
+                p += blen;
+            }
+            length = p;
+            return true;
+        };
+        std::copy(c.data, c.data + length, input.begin());
+        if (!decompress() && (!decrypt() || !decompress())) {
+            log << "Unable to inflate: 0x" << std::setfill('0') << std::setw(2)
+                << std::hex << (unsigned)c.data[0] << " 0x" << std::setfill('0')
+                << std::setw(2) << std::hex << static_cast<unsigned>(c.data[1])
+                << std::endl;
+            // Just fill the image with blank data so nothing breaks
+            f1 = 2;
+            f2 = 0;
+            decompressed = size;
+            std::fill(output.begin(), output.begin() + size, '\0');
+        }
+        input.swap(output);
+        //Sanity check the sizes
+        auto check = decompressed;
+        switch (f1) {
+        case 1: check *= 2; break;
+        case 2: break;
+        case 513: check *= 2; break;
+        case 1026: check *= 4; break;
+        }
+        auto pixels = c.width * c.height;
+        switch (f2) {
+        case 0: break;
+        case 4: pixels /= 256; break;
+        }
+        if (check != pixels * 4) {
+            log << "Size mismatch: " << std::dec << c.width << "," << c.height << "," << decompressed << "," << f1 << "," << f2 << std::endl;
+            throw std::runtime_error("halp!");
+        }
+        if (keep_dxt && f1 == 1026 && f2 == 0 && c.width % 4 == 0 && c.height % 4 == 0) {
+            // The BGRA path below stores what squish gives as RGBA, so red and blue trade places
+            pixels::swap_block_rb(input.data(), static_cast<size_t>(pixels / 16));
+            return codec::format::bc2;
+        }
+        switch (f1) {
+        case 1:
+            pixels::expand4444(input.data(), output.data(), static_cast<size_t>(pixels));
+            input.swap(output);
+            break;
+        case 2:
+            // Do nothing
+            break;
+        case 513:
+            pixels::expand565(input.data(), output.data(), static_cast<size_t>(pixels));
+            input.swap(output);
+            break;
+        case 1026:
+            squish::DecompressImage(output.data(), c.width, c.height, input.data(), squish::kDxt3);
+            input.swap(output);
+            break;
+        default:
+            log << "Unknown image format1 of" << std::dec << f1 << std::endl;
+            throw std::runtime_error("Unknown image type!");
+        }
+        switch (f2) {
+        case 0:
+            // Do nothing
+            break;
+        case 4:
+            log << "Format2 of 4 at " << std::dec << index << std::endl;
+            pixels::scale(input.data(), output.data(), c.width, c.height, 16);
+            input.swap(output);
+            break;
+        default:
+            log << "Unknown image format2 of" << std::dec << static_cast<unsigned>(f2) << std::endl;
+            throw std::runtime_error("Unknown image type!");
+        }
+        return codec::format::bgra8888;
+    }
+    // Block compresses the BGRA8888 pixels at the start of input, with BC1 when one bit of alpha
+    // is enough and BC3 otherwise, leaving the blocks at the start of input
+    codec::format compress_blocks(int32_t width, int32_t height, std::vector<uint8_t> & input,
+        std::vector<uint8_t> & output) {
+        auto count = static_cast<size_t>(width * height);
+        auto format = pixels::binary_alpha(input.data(), count) ? codec::format::bc1
+                                                                : codec::format::bc3;
+        auto flags = (format == codec::format::bc1 ? squish::kDxt1 : squish::kDxt5)
+            | (hc ? squish::kColourClusterFit : squish::kColourRangeFit);
+        // squish wants RGBA
+        output.resize(std::max(output.size(), count * 4));
+        pixels::swap_rb(input.data(), output.data(), count);
+        input.resize(std::max(input.size(),
+            static_cast<size_t>(squish::GetStorageRequirements(width, height, flags))));
+        squish::CompressImage(output.data(), width, height, input.data(), flags);
+        return format;
+    }
+    // Decodes a canvas into whatever gets stored in the NX file, at the start of input
+    codec::format decode_bitmap(size_t index, std::vector<uint8_t> & input,
+        std::vector<uint8_t> & output) {
+        auto & b = bitmaps[index];
+        auto c = read_canvas(b);
+        auto format = decode_canvas(c, b.key, input, output, index, blocks);
+        if (blocks && format == codec::format::bgra8888)
+            format = compress_blocks(c.width, c.height, input, output);
+        return format;
+    }
+    // Trains the dictionary for lz4dict on an even spread of the small bitmaps
+    std::vector<char> train_dictionary() {
+        std::vector<uint8_t> samples;
+        std::vector<size_t> sizes;
+        std::vector<uint8_t> input;
+        std::vector<uint8_t> output;
+        auto step = std::max<size_t>(bitmaps.size() / codec::max_samples, 1);
+        for (auto index = size_t{0}; index < bitmaps.size(); index += step) {
+            if (samples.size() >= codec::sample_budget) break;
+            auto c = read_canvas(bitmaps[index]);
+            if (static_cast<size_t>(c.width * c.height * 4) > codec::small_bitmap) continue;
+            auto size = codec::length(decode_bitmap(index, input, output), c.width, c.height);
+            if (size == 0) continue;
+            samples.insert(samples.end(), input.begin(), input.begin() + static_cast<ptrdiff_t>(size));
+            sizes.push_back(size);
+        }
+        return codec::train(samples, sizes);
     }
     void write_bitmaps() {
-        std::cout << "Writing bitmaps.....";
-        out.seek(bitmap_table_offset);
-        std::ofstream file(nxfilename, std::ios::app | std::ios::binary);
+        progress << "Writing bitmaps.....";
+        out.pad_to(bitmap_offset);
+        spill_vector<uint64_t> table{spill_dir};
+        table.reserve(bitmaps.size() + level_count);
+        table.resize(bitmaps.size());
+        // Where the levels are, to go after the bitmaps in the table
+        spill_vector<uint64_t> extra{spill_dir};
         std::vector<uint8_t> input;
         std::vector<uint8_t> output;
-        for (auto index = 0u; index < bitmaps.size(); ++index) {
+        std::vector<uint8_t> level;
+        std::vector<uint8_t> blob;
+        std::vector<uint8_t> level_blob;
+        std::vector<uint8_t> pending;
+        // The dictionary goes in front of the bitmaps, which refer to it by relative offset
+        std::vector<char> dictionary;
+        if (client && codec::uses_dictionary(policy)) dictionary = train_dictionary();
+        auto dictionary_offset = bitmap_offset;
+        if (!dictionary.empty()) {
+            out.write(static_cast<uint32_t>(dictionary.size()));
+            out.write(dictionary.data(), dictionary.size());
+            bitmap_offset += 4 + dictionary.size();
+        }
+        codec::encoder encoder{policy, hc, zstd_level, dictionary};
+        auto reused = size_t{0};
+        for (auto n = size_t{0}; n < bitmaps.size(); ++n) {
+            auto index = bitmap_order.empty() ? static_cast<uint32_t>(n) : bitmap_order[n];
             auto & b = bitmaps[index];
-            out.write<uint64_t>(bitmap_offset);
-            in.seek(b.data);
-            auto width = in.read_cint();
-            auto height = in.read_cint();
-            if (width < 0 || height < 0) {
-                std::cerr << "Invalid image size: " << std::dec << width << ", " << height << std::endl;
-                throw std::runtime_error{"fak"};
-            }
-            auto f1 = in.read_cint();
-            auto f2 = static_cast<unsigned>(in.read<uint8_t>()); // Cast away from char to preserve sanity
-            auto n1 = in.read<uint32_t>();
-            if (n1) {
-                std::cerr << "non-zero n1: "
-                    << "0x" << std::setfill('0') << std::setw(8) << std::hex << n1;
-                throw std::runtime_error{"fak"};
-            }
-            auto length = in.read<uint32_t>();
-            auto n2 = static_cast<unsigned>(in.read<uint8_t>());
-            if (n2) {
-                std::cerr << "non-zero n2: "
-                    << " 0x" << std::setfill('0') << std::setw(2) << std::hex
-                    << n2 << std::endl;
-                throw std::runtime_error{"fak"};
-            }
-            auto size = width * height * 4;
-            auto biggest = std::max(static_cast<uint32_t>(size), length);
-            input.resize(biggest);
-            output.resize(biggest);
-            auto original = reinterpret_cast<uint8_t const *>(in.offset);
-            auto key = b.key;
-            auto decompressed = 0;
-            auto decompress = [&] {
-                z_stream strm = {};
-                strm.next_in = input.data();
-                strm.avail_in = length;
-                inflateInit(&strm);
-                strm.next_out = output.data();
-                strm.avail_out = static_cast<unsigned>(output.size());
-                auto err = inflate(&strm, Z_FINISH);
-                if (err != Z_BUF_ERROR) {
-                    if (err != Z_DATA_ERROR) { std::cerr << "zlib error of " << std::dec << err << std::endl; }
-                    return false;
-                }
-                decompressed = static_cast<int>(strm.total_out);
-                inflateEnd(&strm);
-                return true;
-            };
-            auto decrypt = [&] {
-                auto p = 0u;
-                for (auto i = 0u; i <= length - 4;) {
-                    auto blen = *reinterpret_cast<uint32_t const *>(original + i);
-                    i += 4;
-                    if (i + blen > length) return false;
-                    for (auto j = 0u; j < blen; ++j)
-                        input[p + j] = static_cast<uint8_t>(original[i + j] ^ key[j]);
-                    i += blen;
-                    p += blen;
+            table[index] = bitmap_offset;
+            auto c = read_canvas(b);
+            // The same bytes decrypted with a different key are a different image. Streaming
+            // doesn't keep track of them, since that would take memory for each one.
+            auto source = window ? 0 : cache::hash(in.base + b.data,
+                in.tell() + c.length - b.data,
+                cache::hash(b.key->raw.data(), std::min<size_t>(b.key->raw.size(), 16)));
+            if (previous) {
+                auto it = previous_manifest.bitmaps.find(source);
+                if (it != previous_manifest.bitmaps.end()
+                    && codec::relocatable(previous->base + it->second.offset)) {
+                    out.write(previous->base + it->second.offset,
+                        static_cast<size_t>(it->second.size));
+                    manifest.bitmaps[source] = {bitmap_offset, it->second.size};
+                    bitmap_offset += it->second.size;
+                    ++reused;
+                    continue;
                 }
-                length = p;
-                return true;
-            };
-            std::copy(original, original + length, input.begin());
-            if (!decompress() && (!decrypt() || !decompress())) {
-                std::cerr << "Unable to inflate: 0x" << std::setfill('0') << std::setw(2)
-                    << std::hex << (unsigned)original[0] << " 0x" << std::setfill('0')
-                    << std::setw(2) << std::hex << static_cast<unsigned>(original[1])
-                    << std::endl;
-                // Just fill the image with blank data so nothing breaks
-                f1 = 2;
-                f2 = 0;
-                decompressed = size;
-                std::fill(output.begin(), output.begin() + size, '\0');
-            }
-            input.swap(output);
-            struct color4444 {
-                uint8_t b : 4;
-                uint8_t g : 4;
-                uint8_t r : 4;
-                uint8_t a : 4;
-            };
-            static_assert(sizeof(color4444) == 2, "Your bitpacking sucks");
-            struct color8888 {
-                uint8_t b;
-                uint8_t g;
-                uint8_t r;
-                uint8_t a;
-            };
-            static_assert(sizeof(color8888) == 4, "Your bitpacking sucks");
-            struct color565 {
-                uint16_t b : 5;
-                uint16_t g : 6;
-                uint16_t r : 5;
-            };
-            static_assert(sizeof(color565) == 2, "Your bitpacking sucks");
-            auto pixels4444 = reinterpret_cast<color4444 *>(input.data());
-            auto pixels565 = reinterpret_cast<color565 *>(input.data());
-            auto pixelsout = reinterpret_cast<color8888 *>(output.data());
-            //Sanity check the sizes
-            auto check = decompressed;
-            switch (f1) {
-            case 1: check *= 2; break;
-            case 2: break;
-            case 513: check *= 2; break;
-            case 1026: check *= 4; break;
             }
-            auto pixels = width * height;
-            switch (f2) {
-            case 0: break;
-            case 4: pixels /= 256; break;
-            }
-            if (check != pixels * 4) {
-                std::cerr << "Size mismatch: " << std::dec << width << "," << height << "," << decompressed << "," << f1 << "," << f2 << std::endl;
-                throw std::runtime_error("halp!");
-            }
-            switch (f1) {
-            case 1:
-                for (auto i = 0; i < pixels; ++i) {
-                    auto p = pixels4444[i];
-                    pixelsout[i] = {table4[p.b], table4[p.g], table4[p.r], table4[p.a]};
-                }
-                input.swap(output);
-                break;
-            case 2:
-                // Do nothing
-                break;
-            case 513:
-                for (auto i = 0; i < pixels; ++i) {
-                    auto p = pixels565[i];
-                    pixelsout[i] = {table5[p.b], table6[p.g], table5[p.r], 255};
+            auto format = decode_canvas(c, b.key, input, output, index, blocks);
+            auto levels = codec::levels(c.width, c.height, mips);
+            auto width = c.width;
+            auto height = c.height;
+            if (levels) {
+                // The levels are made from the full pixels, even if this is staying as DXT3
+                auto count = static_cast<size_t>(width * height);
+                level.resize(std::max(count * 4, input.size()));
+                if (format == codec::format::bc2) {
+                    squish::DecompressImage(output.data(), width, height, input.data(),
+                        squish::kDxt3);
+                    pixels::swap_rb(output.data(), level.data(), count);
+                } else {
+                    std::copy(input.begin(), input.begin() + static_cast<ptrdiff_t>(count * 4),
+                        level.begin());
                 }
-                input.swap(output);
-                break;
-            case 1026:
-                squish::DecompressImage(output.data(), width, height, input.data(), squish::kDxt3);
-                input.swap(output);
-                break;
-            default:
-                std::cerr << "Unknown image format1 of" << std::dec << f1 << std::endl;
-                throw std::runtime_error("Unknown image type!");
-            }
-            switch (f2) {
-            case 0:
-                // Do nothing
-                break;
-            case 4:
-                std::cerr << "Format2 of 4 at " << std::dec << index << std::endl;
-                scale<16>(input, output, width, height);
-                input.swap(output);
-                break;
-            default:
-                std::cerr << "Unknown image format2 of" << std::dec << static_cast<unsigned>(f2) << std::endl;
-                throw std::runtime_error("Unknown image type!");
             }
-            output.resize(static_cast<size_t>(LZ4_compressBound(size)));
-            uint32_t final_size;
-            if (hc) {
-                final_size = static_cast<uint32_t>(
-                    LZ4_compressHC(reinterpret_cast<char const *>(input.data()),
-                        reinterpret_cast<char *>(output.data()), size));
-            } else {
-                final_size = static_cast<uint32_t>(
-                    LZ4_compress(reinterpret_cast<char const *>(input.data()),
-                        reinterpret_cast<char *>(output.data()), size));
+            if (blocks && format == codec::format::bgra8888)
+                format = compress_blocks(width, height, input, output);
+            auto base = bitmap_offset;
+            encoder.encode(format, input.data(), codec::length(format, width, height),
+                static_cast<int64_t>(dictionary_offset) - static_cast<int64_t>(base), levels,
+                blob);
+            bitmap_offset += blob.size();
+            // The levels follow right after, so the links can be filled in before writing
+            pending.clear();
+            for (auto n = 1u; n <= levels; ++n) {
+                pixels::halve(level.data(), output.data(), width, height);
+                width = (width + 1) / 2;
+                height = (height + 1) / 2;
+                auto end = output.begin() + width * height * 4;
+                std::copy(output.begin(), end, level.begin());
+                std::copy(output.begin(), end, input.begin());
+                auto level_format = blocks ? compress_blocks(width, height, input, output)
+                                           : codec::format::bgra8888;
+                encoder.encode(level_format, input.data(),
+                    codec::length(level_format, width, height),
+                    static_cast<int64_t>(dictionary_offset) - static_cast<int64_t>(bitmap_offset),
+                    0, level_blob);
+                codec::link(blob, n, static_cast<int64_t>(bitmap_offset - base));
+                extra.push_back(bitmap_offset);
+                bitmap_offset += level_blob.size();
+                pending.insert(pending.end(), level_blob.begin(), level_blob.end());
             }
-            bitmap_offset += final_size + 4;
-            file.write(reinterpret_cast<char const *>(&final_size), 4);
-            file.write(reinterpret_cast<char const *>(output.data()), final_size);
+            if (!window) manifest.bitmaps[source] = {base, blob.size()};
+            out.write(blob.data(), blob.size());
+            out.write(pending.data(), pending.size());
         }
-        std::cout << "Done!" << std::endl;
+        table.append(extra.data(), extra.size());
+        out.patch(bitmap_table_offset, table.data(), table.size() * 8);
+        if (previous) progress << "Reused " << std::dec << reused << "/" << bitmaps.size() << "...";
+        progress << "Done!" << std::endl;
     }
-    wztonx(sys::path filename, bool client, bool hc) : client(client), hc(hc) {
+    wztonx(sys::path filename, bool client, bool hc, std::ostream & progress = std::cout,
+        std::ostream & log = std::cerr)
+        : client(client), hc(hc), progress(progress), log(log) {
+        nodes.resize(1);
         wzfilename = u8string(filename);
         nxfilename = u8string(filename.replace_extension(".nx"));
+        cachefilename = u8string(filename.replace_extension(".nxcache"));
+        tempfilename = nxfilename + ".tmp";
         if (!std::ifstream{wzfilename}.is_open()) { return; }
-        std::cout << wzfilename << " -> " << nxfilename << std::endl;
+        progress << wzfilename << " -> " << nxfilename << std::endl;
+    }
+    // Hashes an existing file, returning 0 if it doesn't exist
+    uint64_t hash_file(std::string const & name) {
+        if (!sys::exists(name)) return 0;
+        imapfile f;
+        f.open(name);
+        return cache::hash(f.base, f.file_size);
     }
     void convert_file() {
+        // Left over from a conversion that failed
+        if (sys::exists(tempfilename)) sys::remove(tempfilename);
+        // Older versions moved the NX file here while converting, and lost it if that failed
+        auto oldfilename = nxfilename + ".old";
+        if (sys::exists(oldfilename)) {
+            if (sys::exists(nxfilename)) {
+                sys::remove(oldfilename);
+            } else { sys::rename(oldfilename, nxfilename); }
+        }
+        in.open(wzfilename);
+        manifest.input = cache::hash(in.base, in.file_size);
+        manifest.client = client;
+        manifest.hc = hc;
+        manifest.codec = codec::name(policy);
+        if (policy == codec::policy::zstd || policy == codec::policy::automatic)
+            manifest.codec += std::to_string(zstd_level);
+        // The 2 is for kept DXT3 having its endpoints swapped, so older BC2 isn't reused
+        if (blocks) manifest.codec += "+bc2";
+        if (mips) manifest.codec += "+mips" + std::to_string(mips);
+        manifest.filter = rules.hash();
+        manifest.order = 0;
+        for (auto & o : order) {
+            auto seed = manifest.order + o.first;
+            manifest.order = cache::hash(o.second.data(), o.second.size(), seed);
+        }
+        // Streaming doesn't reuse bitmaps, so it doesn't need to know where they were
+        if (use_cache && previous_manifest.load(cachefilename, !window)
+            && previous_manifest.output == hash_file(nxfilename)) {
+            if (previous_manifest.input == manifest.input && previous_manifest.client == client
+                && previous_manifest.hc == hc && previous_manifest.codec == manifest.codec
+                && previous_manifest.filter == manifest.filter
+                && previous_manifest.order == manifest.order) {
+                progress << "Up to date, skipping" << std::endl;
+                return;
+            }
+            // Only reuse bitmaps compressed the same way they would be now
+            if (client && previous_manifest.client && previous_manifest.hc == hc
+                && previous_manifest.codec == manifest.codec && !previous_manifest.bitmaps.empty()) {
+                previous.reset(new imapfile);
+                previous->open(nxfilename);
+            }
+        }
+        if (window) {
+            auto dir = sys::path{nxfilename}.parent_path();
+            spill_dir = dir.empty() ? std::string{"."} : u8string(dir);
+            nodes.spill(spill_dir);
+            nodes_to_sort.spill(spill_dir);
+            string_map.spill(spill_dir);
+            strings.spill(spill_dir);
+            imgs.spill(spill_dir);
+            uols.spill(spill_dir);
+            uol_state.spill(spill_dir);
+            uol_index.spill(spill_dir);
+            refs.spill(spill_dir);
+            ref_maps.spill(spill_dir);
+            ref_state.spill(spill_dir);
+            ref_index.spill(spill_dir);
+            bitmaps.spill(spill_dir);
+            audios.spill(spill_dir);
+            string_order.spill(spill_dir);
+            bitmap_order.spill(spill_dir);
+            // A quarter of the window goes to the string index
+            string_slots = 0x10000;
+            while (string_slots * 2 * sizeof(string_slot) <= window / 4) string_slots *= 2;
+            reserve_tables(count_file());
+        }
         parse_file();
         open_output();
         write_nodes();
@@ -1009,24 +1956,172 @@ struct wztonx {
             write_audio();
             write_bitmaps();
         }
+        // Without bitmaps the file still ends with the padding after the last section
+        out.pad_to(std::max<uint64_t>(out.tell(), bitmap_offset));
+        out.close();
+        // The previous file has to be unmapped before it can be replaced
+        previous.reset();
+        sys::rename(tempfilename, nxfilename);
+        manifest.output = hash_file(nxfilename);
+        manifest.save(cachefilename);
     }
 };
 struct imgtonx : wztonx {
-    imgtonx(sys::path filename, bool client, bool hc) : wztonx{filename, client, hc} {}
+    imgtonx(sys::path filename, bool client, bool hc, std::ostream & progress = std::cout,
+        std::ostream & log = std::cerr)
+        : wztonx{filename, client, hc, progress, log} {}
+    table_sizes count_file() override {
+        progress << "Sizing tables.......";
+        table_sizes sizes;
+        in.seek(0);
+        count_img(sizes, 0);
+        progress << std::dec << sizes.nodes << " nodes...Done!" << std::endl;
+        return sizes;
+    }
     void parse_file() override {
-        std::cout << "Parsing input.......";
-        in.open(wzfilename);
+        progress << "Parsing input.......";
         add_string({});
         img(0, 0);
         finish_parse();
     }
 };
 }
+namespace {
+// Amount of physical memory, or 0 if it couldn't be determined
+uint64_t physical_memory() {
+#ifdef _WIN32
+    MEMORYSTATUSEX status{};
+    status.dwLength = sizeof(status);
+    if (!GlobalMemoryStatusEx(&status)) return 0;
+    return status.ullTotalPhys;
+#else
+    auto pages = sysconf(_SC_PHYS_PAGES);
+    auto page_size = sysconf(_SC_PAGE_SIZE);
+    if (pages <= 0 || page_size <= 0) return 0;
+    return static_cast<uint64_t>(pages) * static_cast<uint64_t>(page_size);
+#endif
+}
+// What a trace recorded by the nx library says got used, by file name without the extension
+using trace_t = std::map<std::string, std::vector<std::pair<bool, std::string>>>;
+void load_trace(std::string const & path, trace_t & trace) {
+    std::ifstream file{path};
+    std::string line;
+    if (!std::getline(file, line) || line != "nxtrace 1")
+        throw std::runtime_error{"Not a trace: " + path};
+    while (std::getline(file, line)) {
+        std::istringstream words{line};
+        std::string time, kind, name;
+        if (!(words >> time >> kind >> name)) continue;
+        // The path is the rest of the line, and is empty for the root
+        words.get();
+        std::string rest;
+        std::getline(words, rest);
+        trace[name].emplace_back(kind == "bitmap", rest);
+    }
+}
+// Converts a bunch of files at once, biggest first, without going over the thread and memory
+// budgets. A file is assumed to need about as much memory as its own size, since the whole input
+// gets mapped and walked. A file larger than the whole budget still gets converted, just alone.
+// With no budget at all, the files go one at a time with every thread.
+class scheduler {
+public:
+    struct job {
+        sys::path path;
+        uint64_t size;
+    };
+    // Called on every converter before it starts, to apply any other options
+    using setup_t = std::function<void(nl::wztonx &)>;
+    scheduler(std::vector<job> jobs, unsigned threads, uint64_t memory, bool client, bool hc,
+        setup_t setup)
+        : jobs(std::move(jobs)), threads(std::max(threads, 1u)), available(memory),
+          client(client), hc(hc), setup(std::move(setup)) {
+        std::stable_sort(this->jobs.begin(), this->jobs.end(),
+            [](job const & a, job const & b) { return a.size > b.size; });
+    }
+    // Returns the number of files that failed to convert
+    unsigned run() {
+        auto count = available ? std::min<size_t>(threads, jobs.size()) : 1;
+        // Whatever threads aren't needed for separate files can help within a file
+        inner = std::max(threads / static_cast<unsigned>(std::max<size_t>(count, 1)), 1u);
+        if (count <= 1) {
+            for (auto & j : jobs) convert(j, std::cout, std::cerr);
+            return failed;
+        }
+        std::vector<std::thread> workers;
+        for (auto i = size_t{0}; i < count; ++i) workers.emplace_back([this] { work(); });
+        for (auto & w : workers) w.join();
+        return failed;
+    }
+private:
+    void work() {
+        std::unique_lock<std::mutex> lock{mutex};
+        for (;;) {
+            if (jobs.empty()) return;
+            auto it = std::find_if(jobs.begin(), jobs.end(),
+                [this](job const & j) { return running == 0 || j.size <= available; });
+            if (it == jobs.end()) {
+                done.wait(lock);
+                continue;
+            }
+            auto j = *it;
+            jobs.erase(it);
+            auto cost = std::min(j.size, available);
+            available -= cost;
+            ++running;
+            lock.unlock();
+            // Keep each file's output together instead of interleaving it with everyone else's
+            std::ostringstream progress, log;
+            convert(j, progress, log);
+            {
+                std::lock_guard<std::mutex> guard{output};
+                std::cout << progress.str() << std::flush;
+                std::cerr << log.str() << std::flush;
+            }
+            lock.lock();
+            available += cost;
+            --running;
+            done.notify_all();
+        }
+    }
+    void convert(job const & j, std::ostream & progress, std::ostream & log) {
+        try {
+            auto ext = u8string(j.path.extension());
+            if (ext == ".img") {
+                nl::imgtonx c{j.path, client, hc, progress, log};
+                c.threads = inner;
+                setup(c);
+                c.convert_file();
+            } else if (ext == ".wz") {
+                nl::wztonx c{j.path, client, hc, progress, log};
+                c.threads = inner;
+                setup(c);
+                c.convert_file();
+            }
+        } catch (std::exception const & e) {
+            ++failed;
+            progress << std::endl << "Failed to convert " << u8string(j.path) << ": " << e.what()
+                     << std::endl;
+            log << "Failed to convert " << u8string(j.path) << ": " << e.what() << std::endl;
+        }
+    }
+    std::vector<job> jobs;
+    unsigned threads;
+    unsigned inner = 1;
+    uint64_t available;
+    unsigned running = 0;
+    bool client, hc;
+    setup_t setup;
+    std::atomic<unsigned> failed{0};
+    std::mutex mutex, output;
+    std::condition_variable done;
+};
+}
 int main(int argc, char ** argv) {
     auto old = std::cerr.rdbuf();
     auto log = std::ofstream{"NoLifeWzToNx.log"};
     std::cerr.rdbuf(log.rdbuf());
     auto a = std::chrono::high_resolution_clock::now();
+    std::cerr << "Using " << nl::pixels::isa() << " pixel kernels" << std::endl;
 #ifdef NL_NO_CODECVT
     std::setlocale(LC_ALL, "en_US.utf8");
 #endif
@@ -1038,37 +2133,141 @@ Converts WZ files into NX files
     std::vector<std::string> args{argv + 1, argv + argc};
     enum { client, server, none } type{none};
     bool hc{false};
+    bool batch{false};
+    bool force{false};
+    // How much memory streaming keeps the process within, 0 for not streaming
+    auto window = uint64_t{0};
+    bool direct{false};
+    bool blocks{false};
+    auto mips = 0u;
+    auto policy = nl::codec::policy::lz4;
+    auto zstd_level = 12;
+    auto threads = std::max(std::thread::hardware_concurrency(), 1u);
+    // Half of physical memory by default, leaving room for everything else
+    auto memory = physical_memory() / 2;
+    if (memory == 0) memory = std::numeric_limits<uint64_t>::max();
     std::vector<sys::path> paths;
-    std::regex reg1{"--([a-z]+)"};
-    std::regex reg2{"-([a-z]+)"};
+    std::regex threads_reg{"--threads=([0-9]+)"};
+    std::regex memory_reg{"--memory=([0-9]+)"};
+    std::regex codec_reg{"--codec=(.+)"};
+    std::regex level_reg{"--level=([0-9]+)"};
+    std::regex mips_reg{"--mips=([0-9]+)"};
+    std::regex stream_reg{"--stream=([0-9]+)"};
+    std::vector<std::string> filters;
+    std::vector<std::string> traces;
     for (auto & arg : args) {
         if (arg[0] != '-') {
             paths.emplace_back(arg);
             continue;
         }
+        // A file of rules for which nodes to leave out, see filter.hpp. Checked before lowering
+        // the case so the path stays intact.
+        if (arg.compare(0, 9, "--filter=") == 0) {
+            filters.push_back(arg.substr(9));
+            continue;
+        }
+        // A trace from the nx library, to lay the files it covers out in the order it used them
+        if (arg.compare(0, 8, "--order=") == 0) {
+            traces.push_back(arg.substr(8));
+            continue;
+        }
         for (auto & c : arg) { c = std::tolower(c, std::locale::classic()); }
+        std::smatch match;
         if (arg == "--client" || arg == "-c") {
             type = client;
         } else if (arg == "--server" || arg == "-s") {
             type = server;
-        } else if (arg == "--lz4hc" || arg == "-h") { hc = true; }
+        } else if (arg == "--lz4hc" || arg == "-h") {
+            hc = true;
+        } else if (arg == "--batch" || arg == "-b") {
+            batch = true;
+        } else if (arg == "--force" || arg == "-f") {
+            // Ignore the .nxcache and convert everything from scratch
+            force = true;
+        } else if (arg == "--stream") {
+            // Size the tables in a first pass and keep them in temporary files, so that memory
+            // use stays within a window instead of growing with the input
+            window = 256ull << 20;
+        } else if (std::regex_match(arg, match, stream_reg)) {
+            // The window given in MiB
+            window = std::stoull(match[1]) << 20;
+        } else if (arg == "--direct") {
+            // Write the output without going through the OS cache
+            direct = true;
+        } else if (arg == "--bc") {
+            // Store bitmaps as BC1, BC2 or BC3 instead of BGRA8888
+            blocks = true;
+        } else if (arg == "--mips") {
+            // Half and quarter size versions of every bitmap
+            mips = 2;
+        } else if (std::regex_match(arg, match, mips_reg)) {
+            mips = std::min(static_cast<unsigned>(std::stoul(match[1])), nl::codec::max_levels);
+        } else if (std::regex_match(arg, match, threads_reg)) {
+            threads = static_cast<unsigned>(std::stoul(match[1]));
+        } else if (std::regex_match(arg, match, memory_reg)) {
+            // Given in MiB
+            memory = std::stoull(match[1]) << 20;
+        } else if (std::regex_match(arg, match, codec_reg)) {
+            // One of lz4, zstd, lz4dict, raw or auto
+            if (!nl::codec::parse(match[1], policy))
+                std::cout << "Unsupported codec " << match[1] << ", using lz4" << std::endl;
+        } else if (std::regex_match(arg, match, level_reg)) {
+            // How hard zstd tries
+            zstd_level = std::stoi(match[1]);
+        } else { std::cout << "Ignoring unknown option " << arg << std::endl; }
     }
-    auto convert = [&](sys::path const & p) {
-        if (u8string(p.extension()) == ".img") {
-            nl::imgtonx{p, type == client, hc}.convert_file();
-        } else if (u8string(p.extension()) == ".wz") {
-            nl::wztonx{p, type == client, hc}.convert_file();
-        }
+    std::vector<scheduler::job> jobs;
+    auto add = [&](sys::path const & p) {
+        auto ext = u8string(p.extension());
+        if (ext != ".img" && ext != ".wz") return;
+        jobs.push_back({p, static_cast<uint64_t>(sys::file_size(p))});
     };
-    for (auto & p : paths) {
-        if (sys::is_regular_file(p)) { convert(p); } else if (sys::is_directory(p)) {
-            for (sys::recursive_directory_iterator it{p}, end{}; it != end; ++it) { convert(*it); }
+    nl::filter rules;
+    trace_t trace;
+    try {
+        // Anything explicitly asked for wins over the preset
+        if (type == server) rules.parse(nl::filter::server);
+        for (auto & f : filters) rules.load(f);
+        for (auto & t : traces) load_trace(t, trace);
+        for (auto & p : paths) {
+            if (sys::is_regular_file(p)) { add(p); } else if (sys::is_directory(p)) {
+                for (sys::recursive_directory_iterator it{p}, end{}; it != end; ++it) {
+                    if (sys::is_regular_file(*it)) add(*it);
+                }
+            } else {
+                throw std::runtime_error{"No such file or directory: " + u8string(p)};
+            }
         }
+    } catch (std::exception const & e) {
+        std::cout << e.what() << std::endl;
+        std::cerr << e.what() << std::endl;
+        std::cerr.rdbuf(old);
+        return 2;
     }
+    auto total = jobs.size();
+    // The files are converted one at a time, since each one can take up the whole window
+    if (window) {
+        nl::limit_resident(window);
+        memory = 0;
+    }
+    auto setup = [&](nl::wztonx & c) {
+        c.use_cache = !force;
+        c.window = window;
+        c.direct = direct;
+        c.blocks = blocks;
+        c.mips = mips;
+        c.policy = policy;
+        c.zstd_level = zstd_level;
+        c.rules = rules;
+        auto it = trace.find(u8string(sys::path{c.wzfilename}.stem()));
+        if (it != trace.end()) c.order = it->second;
+    };
+    auto failed = scheduler{std::move(jobs), threads, memory, type == client, hc, setup}.run();
     auto b = std::chrono::high_resolution_clock::now();
-    std::cout << "Took " << std::dec
+    std::cout << "Converted " << std::dec << total - failed << " of " << total << " files in "
         << std::chrono::duration_cast<std::chrono::seconds>(b - a).count() << " seconds"
         << std::endl;
-    std::cin.get();
+    if (!batch) std::cin.get();
     std::cerr.rdbuf(old);
+    return failed ? 1 : 0;
 }